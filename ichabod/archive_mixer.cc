@@ -11,143 +11,305 @@ extern "C" {
 #include <uv.h>
 #include "archive_mixer.h"
 #include "audio_mixer.h"
-#include "growing_file_audio_source.h"
 #include "video_frame_buffer.h"
 #include "audio_frame_converter.h"
 #include "pulse_audio_source.h"
 }
 
-#include <map>
-#include <string>
+// runs each stream can queue before the consumer falls too far behind.
+// a power of two, so indexes can wrap freely. 20 seconds or more of either.
+#define FRAME_RING_SIZE 1024
+
+/**
+ * Bounded queue between one producer thread and one consumer thread, with no
+ * lock. Only the producer moves tail and only the consumer moves head; each
+ * publishes with a release store and reads the other side with an acquire
+ * load. The two indexes sit on separate cache lines.
+ *
+ * Entries are runs: a frame and any repeats that follow it. The consumer
+ * clones repeats as it reads them, so a still picture takes one entry however
+ * long it lasts.
+ */
+struct frame_ring_s {
+  struct frame_run_s runs[FRAME_RING_SIZE];
+  // uv_hrtime() when each run was pushed
+  uint64_t arrivals[FRAME_RING_SIZE];
+  uint32_t head;
+  char head_padding[64 - sizeof(uint32_t)];
+  uint32_t tail;
+  char tail_padding[64 - sizeof(uint32_t)];
+};
+
+// audio and video today. room for more tracks or renditions.
+#define MIXER_MAX_INPUTS 8
+
+/**
+ * One stream of frames into the merge, in its own time base. Frames on an
+ * input must come in pts order.
+ */
+struct mixer_input_s {
+  struct frame_ring_s ring;
+  AVRational time_base;
+  enum AVMediaType media_type;
+  const char* name;
+  // pts of the newest frame pushed, or AV_NOPTS_VALUE before the first.
+  // written by the producer, read by the consumer.
+  int64_t last_pts;
+  // consumer only: the ring's head frame is in the merge heap
+  char is_merging;
+};
 
 struct archive_mixer_s {
   double first_video_ts;
   double first_audio_ts;
   double min_buffer_time;
+  // min_buffer_time, in uv_hrtime() units
+  uint64_t max_hold_time;
   struct pulse_s* pulse_audio;
   struct audio_mixer_s* audio_mixer;
   struct frame_converter_s* audio_frame_converter;
+  // constant frame rate only
   struct frame_buffer_s* video_buffer;
-  uv_mutex_t queue_lock;
-  std::map<int64_t, AVFrame*> video_frame_queue;
-  std::map<int64_t, AVFrame*> audio_frame_queue;
-  std::map<std::string, struct audio_source_s*> audio_sources;
+  // variable frame rate only: a reference to the last frame queued, and the
+  // pts gap that has it repeated. zero never repeats.
+  AVFrame* video_tail;
+  int64_t keepalive_interval;
+  struct mixer_input_s inputs[MIXER_MAX_INPUTS];
+  int num_inputs;
+  // written by the pulse worker thread
+  struct mixer_input_s* audio_input;
+  // written by whichever thread consumes video (the horseman loop)
+  struct mixer_input_s* video_input;
+  // consumer only: inputs with a frame waiting, as a min heap on head pts
+  struct mixer_input_s* merge_heap[MIXER_MAX_INPUTS];
+  int merge_heap_size;
 
   AVFormatContext* format_out;
   AVCodecContext* audio_ctx_out;
   AVStream* audio_stream_out;
   AVCodecContext* video_ctx_out;
   AVStream* video_stream_out;
-
-  size_t audio_size_estimated;
-  size_t video_size_estimated;
-
 };
 
 #pragma mark - Private Utilities
 
-static void audio_frame_queue_push_safe
-(struct archive_mixer_s* pthis, AVFrame* frame)
+// pts of the next frame a run reads out
+static inline int64_t frame_run_pts(const struct frame_run_s* run) {
+  return (int64_t)run->next_pts;
+}
+
+// Producer side. Takes ownership of the run's frame, freeing it if the ring
+// is full.
+static void frame_ring_push(struct frame_ring_s* ring,
+                            const struct frame_run_s* run, const char* name)
 {
-  uv_mutex_lock(&pthis->queue_lock);
-  pthis->audio_frame_queue[frame->pts] = frame;
-  pthis->audio_size_estimated = pthis->audio_frame_queue.size();
-  uv_mutex_unlock(&pthis->queue_lock);
+  uint32_t tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+      FRAME_RING_SIZE)
+  {
+    printf("mixer: %s queue full, dropping frame pts %lld\n",
+           name, (long long)frame_run_pts(run));
+    AVFrame* frame = run->frame;
+    av_frame_free(&frame);
+    return;
+  }
+  ring->runs[tail % FRAME_RING_SIZE] = *run;
+  ring->arrivals[tail % FRAME_RING_SIZE] = uv_hrtime();
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
 }
 
-static void video_frame_queue_push_safe
-(struct archive_mixer_s* pthis, AVFrame* frame)
+// Consumer side. Oldest run, left in the ring, or NULL. The consumer may read
+// frames out of it in place.
+static struct frame_run_s* frame_ring_peek(struct frame_ring_s* ring) {
+  uint32_t head = ring->head;
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &ring->runs[head % FRAME_RING_SIZE];
+}
+
+// Consumer side. Drops the run frame_ring_peek returned.
+static void frame_ring_pop(struct frame_ring_s* ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Either side, for estimates.
+static size_t frame_ring_size(struct frame_ring_s* ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+  __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+// Must be called before any frames flow.
+static struct mixer_input_s* mixer_add_input(struct archive_mixer_s* pthis,
+                                             enum AVMediaType media_type,
+                                             AVRational time_base,
+                                             const char* name)
 {
-  uv_mutex_lock(&pthis->queue_lock);
-  pthis->video_frame_queue[frame->pts] = frame;
-  pthis->video_size_estimated = pthis->video_frame_queue.size();
-  uv_mutex_unlock(&pthis->queue_lock);
+  assert(pthis->num_inputs < MIXER_MAX_INPUTS);
+  struct mixer_input_s* input = &pthis->inputs[pthis->num_inputs++];
+  input->media_type = media_type;
+  input->time_base = time_base;
+  input->name = name;
+  input->last_pts = AV_NOPTS_VALUE;
+  return input;
 }
 
-// mergesort-style management of two queues at once. there's probably a cleaner
-// way to do this, but I haven't thought of it yet.
-static int frame_queue_pop_safe(struct archive_mixer_s* pthis,
-                                AVFrame** frame,
-                                enum AVMediaType* media_type)
+// Producer side, one thread per input.
+static void mixer_input_push_run(struct mixer_input_s* input,
+                                 const struct frame_run_s* run)
 {
-  int64_t ahead_pts = -1;
-  int64_t vhead_pts = -1;
-  int64_t atail_pts = -1;
-  int64_t vtail_pts = -1;
-  *media_type = AVMEDIA_TYPE_UNKNOWN;
-  AVFrame* audio_head = NULL;
-  AVFrame* video_head = NULL;
-  AVFrame* ret = NULL;
-  uv_mutex_lock(&pthis->queue_lock);
-  if (!pthis->audio_frame_queue.empty()) {
-    auto audio_it = pthis->audio_frame_queue.begin();
-    audio_head = audio_it->second;
-    ahead_pts = audio_it->second->pts;
-    auto audio_tail_it = pthis->audio_frame_queue.rbegin();
-    atail_pts = audio_tail_it->second->pts;
+  int64_t last_pts = (int64_t)
+  (run->next_pts + (run->slots - 1) * run->interval);
+  frame_ring_push(&input->ring, run, input->name);
+  __atomic_store_n(&input->last_pts, last_pts, __ATOMIC_RELEASE);
+}
+
+static void mixer_input_push(struct mixer_input_s* input, AVFrame* frame) {
+  struct frame_run_s run = { frame, (double)frame->pts, 0, 1 };
+  mixer_input_push_run(input, &run);
+}
+
+// Head frame of a comes strictly before head frame of b. Ties go to the
+// input added first, to keep the order stable.
+static char merge_before(struct mixer_input_s* a, struct mixer_input_s* b) {
+  int cmp = av_compare_ts(frame_run_pts(frame_ring_peek(&a->ring)),
+                          a->time_base,
+                          frame_run_pts(frame_ring_peek(&b->ring)),
+                          b->time_base);
+  return cmp < 0 || (0 == cmp && a < b);
+}
+
+static void merge_heap_push(struct archive_mixer_s* pthis,
+                            struct mixer_input_s* input)
+{
+  struct mixer_input_s** heap = pthis->merge_heap;
+  int i = pthis->merge_heap_size++;
+  while (i > 0 && merge_before(input, heap[(i - 1) / 2])) {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = input;
+  input->is_merging = 1;
+}
+
+// Restores heap order below the root, after its head frame changed.
+static void merge_heap_sift_down(struct archive_mixer_s* pthis) {
+  struct mixer_input_s** heap = pthis->merge_heap;
+  int size = pthis->merge_heap_size;
+  struct mixer_input_s* input = heap[0];
+  int i = 0;
+  while (2 * i + 1 < size) {
+    int child = 2 * i + 1;
+    if (child + 1 < size && merge_before(heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!merge_before(heap[child], input)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
   }
-  if (!pthis->video_frame_queue.empty()) {
-    auto video_it = pthis->video_frame_queue.begin();
-    video_head = video_it->second;
-    vhead_pts = video_it->second->pts;
-    auto video_tail_it = pthis->video_frame_queue.rbegin();
-    vtail_pts = video_tail_it->second->pts;
+  heap[i] = input;
+}
+
+// Inputs that ran dry rejoin the heap once their producer catches up.
+static void merge_heap_refill(struct archive_mixer_s* pthis) {
+  for (int i = 0; i < pthis->num_inputs; i++) {
+    struct mixer_input_s* input = &pthis->inputs[i];
+    if (!input->is_merging && frame_ring_peek(&input->ring)) {
+      merge_heap_push(pthis, input);
+    }
   }
-  if (audio_head && video_head) {
-    // articulate this comparison better: pts are presented in different units
-    // so we need to rescale here before making a fair comparison.
-    ret = (audio_head->pts < video_head->pts * 48) ? audio_head : video_head;
+}
+
+// The heap root can go once no input that has started could still deliver
+// anything before it, or once it has waited out the latency target. Inputs
+// in the heap are never behind the root; the rest are judged by the last pts
+// they pushed, since their frames come in order.
+static char merge_root_is_ready(struct archive_mixer_s* pthis) {
+  struct mixer_input_s* root = pthis->merge_heap[0];
+  uint32_t head = root->ring.head;
+  if (uv_hrtime() - root->ring.arrivals[head % FRAME_RING_SIZE] >=
+      pthis->max_hold_time)
+  {
+    return 1;
   }
-  else if (audio_head) {
-    ret = audio_head;
-  } else if (video_head) {
-    ret = video_head;
+  int64_t pts = frame_run_pts(&root->ring.runs[head % FRAME_RING_SIZE]);
+  for (int i = 0; i < pthis->num_inputs; i++) {
+    struct mixer_input_s* input = &pthis->inputs[i];
+    if (input->is_merging) {
+      continue;
+    }
+    int64_t last_pts = __atomic_load_n(&input->last_pts, __ATOMIC_ACQUIRE);
+    if (AV_NOPTS_VALUE != last_pts &&
+        av_compare_ts(last_pts, input->time_base, pts, root->time_base) < 0)
+    {
+      return 0;
+    }
   }
-  if (ret && audio_head == ret) {
-    pthis->audio_frame_queue.erase(audio_head->pts);
-    *media_type = AVMEDIA_TYPE_AUDIO;
+  return 1;
+}
+
+// k-way merge of the input rings, one frame at a time, in presentation order
+// across all of them. Only the consumer thread calls this.
+static int frame_queue_pop(struct archive_mixer_s* pthis,
+                           AVFrame** frame,
+                           enum AVMediaType* media_type)
+{
+  *media_type = AVMEDIA_TYPE_UNKNOWN;
+  *frame = NULL;
+  merge_heap_refill(pthis);
+  if (!pthis->merge_heap_size || !merge_root_is_ready(pthis)) {
+    return 1;
   }
-  if (ret && video_head == ret) {
-    pthis->video_frame_queue.erase(video_head->pts);
-    *media_type = AVMEDIA_TYPE_VIDEO;
+  struct mixer_input_s* input = pthis->merge_heap[0];
+  struct frame_run_s* run = frame_ring_peek(&input->ring);
+  *frame = frame_run_take(run);
+  *media_type = input->media_type;
+  if (!run->slots) {
+    frame_ring_pop(&input->ring);
+    if (!frame_ring_peek(&input->ring)) {
+      input->is_merging = 0;
+      pthis->merge_heap[0] = pthis->merge_heap[--pthis->merge_heap_size];
+    }
+  }
+  // the root's head pts moved on either way
+  if (pthis->merge_heap_size) {
+    merge_heap_sift_down(pthis);
   }
-  pthis->video_size_estimated = pthis->video_frame_queue.size();
-  pthis->audio_size_estimated = pthis->audio_frame_queue.size();
-  uv_mutex_unlock(&pthis->queue_lock);
-  printf("mixer: %zu audio %zu video frames in queue\n",
-         pthis->audio_size_estimated, pthis->video_size_estimated);
-  printf("mixer: audio head %lld tail %lld video head %lld tail %lld\n",
-         ahead_pts, atail_pts, vhead_pts, vtail_pts);
-  *frame = ret;
-  return (NULL == ret);
+  return *frame ? 0 : 1;
 }
 
-// fetch existing or configure a new audio source
-static int get_audio_source(struct archive_mixer_s* pthis,
-                            const char* subscriber_id,
-                            const char* file_path,
-                            double timestamp,
-                            struct audio_source_s** source_out)
+// Variable frame rate: frames go straight to the queue with the pts they came
+// with. Repeats are only made for gaps longer than keepalive_interval, and go
+// over as one run that the consumer expands as it reads.
+static void consume_video_vfr(struct archive_mixer_s* pthis, AVFrame* frame)
 {
-  int ret;
-  auto it = pthis->audio_sources.find(subscriber_id);
-  if (it != pthis->audio_sources.end()) {
-    *source_out = it->second;
-    return 0;
+  AVFrame* tail = pthis->video_tail;
+  if (tail && frame->pts <= tail->pts) {
+    // same tick as the last one: the encoder needs increasing pts
+    av_frame_free(&frame);
+    return;
   }
-  struct audio_source_s* source;
-  audio_source_alloc(&source);
-  struct audio_source_config_s config;
-  config.path = file_path;
-  config.initial_timestamp = timestamp;
-  ret = audio_source_load_config(source, &config);
-  if (ret) {
-    *source_out = NULL;
-  } else {
-    *source_out = source;
-    pthis->audio_sources[subscriber_id] = source;
+  if (tail && pthis->keepalive_interval > 0) {
+    // one repeat every keepalive_interval, strictly before the new frame
+    int64_t repeats = (frame->pts - tail->pts - 1) / pthis->keepalive_interval;
+    struct frame_run_s run;
+    run.frame = repeats > 0 ? av_frame_clone(tail) : NULL;
+    run.next_pts = tail->pts + pthis->keepalive_interval;
+    run.interval = pthis->keepalive_interval;
+    run.slots = repeats;
+    if (run.frame) {
+      mixer_input_push_run(pthis->video_input, &run);
+    } else if (repeats > 0) {
+      printf("mixer: cannot reference frame pts %lld, skipping %lld "
+             "keepalives\n", (long long)tail->pts, (long long)repeats);
+    }
   }
-  return ret;
+  av_frame_free(&pthis->video_tail);
+  // without a tail, the next gap goes without keepalives
+  pthis->video_tail = av_frame_clone(frame);
+  mixer_input_push(pthis->video_input, frame);
 }
 
 static void setup_audio(struct archive_mixer_s* pthis, AVFrame* frame) {
@@ -173,32 +335,50 @@ int archive_mixer_create(struct archive_mixer_s** mixer_out,
 {
   struct archive_mixer_s* pthis = (struct archive_mixer_s*)
   calloc(1, sizeof(struct archive_mixer_s));
-  pthis->audio_frame_queue = std::map<int64_t, AVFrame*>();
-  pthis->video_frame_queue = std::map<int64_t, AVFrame*>();
-  pthis->audio_sources = std::map<std::string, struct audio_source_s*>();
   pthis->first_video_ts = config->initial_timestamp;
   pthis->min_buffer_time = config->min_buffer_time;
+  if (config->min_buffer_time > 0) {
+    pthis->max_hold_time = (uint64_t)(config->min_buffer_time * 1e9);
+  }
   pthis->format_out = config->format_out;
   pthis->audio_ctx_out = config->audio_ctx_out;
   pthis->video_ctx_out = config->video_ctx_out;
   pthis->audio_stream_out = config->audio_stream_out;
   pthis->video_stream_out = config->video_stream_out;
   pthis->pulse_audio = config->pulse_audio;
+  // audio pts count samples
+  AVRational audio_time_base = { 1, config->audio_ctx_out->sample_rate };
+  pthis->audio_input = mixer_add_input(pthis, AVMEDIA_TYPE_AUDIO,
+                                       audio_time_base, "audio");
+  pthis->video_input = mixer_add_input(pthis, AVMEDIA_TYPE_VIDEO,
+                                       config->video_ctx_out->time_base,
+                                       "video");
   audio_mixer_alloc(&pthis->audio_mixer);
   struct audio_mixer_config_s mixer_config;
   mixer_config.output_codec = config->audio_ctx_out;
   mixer_config.output_format = config->format_out;
   audio_mixer_load_config(pthis->audio_mixer, &mixer_config);
 
-  double pts_interval =
-  (double)config->video_ctx_out->time_base.den / config->video_fps_out;
-  frame_buffer_alloc(&pthis->video_buffer, pts_interval);
-  uv_mutex_init(&pthis->queue_lock);
+  if (config->variable_frame_rate) {
+    pthis->keepalive_interval = (int64_t)
+    (config->max_frame_interval * config->video_ctx_out->time_base.den);
+  } else {
+    double pts_interval =
+    (double)config->video_ctx_out->time_base.den / config->video_fps_out;
+    frame_buffer_alloc(&pthis->video_buffer, pts_interval);
+  }
   *mixer_out = pthis;
   return 0;
 }
 void archive_mixer_free(struct archive_mixer_s* pthis) {
-  uv_mutex_destroy(&pthis->queue_lock);
+  av_frame_free(&pthis->video_tail);
+  for (int i = 0; i < pthis->num_inputs; i++) {
+    struct frame_run_s* run;
+    while ((run = frame_ring_peek(&pthis->inputs[i].ring))) {
+      av_frame_free(&run->frame);
+      frame_ring_pop(&pthis->inputs[i].ring);
+    }
+  }
   free(pthis);
 }
 
@@ -225,7 +405,7 @@ void archive_mixer_drain_audio(struct archive_mixer_s* pthis) {
   ret = frame_converter_get_next(pthis->audio_frame_converter, &frame);
   while (!ret) {
     if (frame) {
-      audio_frame_queue_push_safe(pthis, frame);
+      mixer_input_push(pthis->audio_input, frame);
     }
     ret = frame_converter_get_next(pthis->audio_frame_converter, &frame);
   }
@@ -235,38 +415,37 @@ void archive_mixer_consume_video(struct archive_mixer_s* pthis,
                                  AVFrame* frame, double timestamp)
 {
   frame->pts = (timestamp - (1000 * pthis->first_video_ts));
+  if (!pthis->video_buffer) {
+    consume_video_vfr(pthis, frame);
+    return;
+  }
   frame_buffer_consume(pthis->video_buffer, frame);
-  while (frame_buffer_has_next(pthis->video_buffer)) {
-    int ret = frame_buffer_get_next(pthis->video_buffer, &frame);
-    if (!ret && frame) {
-      video_frame_queue_push_safe(pthis, frame);
-    }
+  // Whole runs go across, and their repeats are cloned as they are read out.
+  // If the queue is full, the rest waits here in the frame buffer, which
+  // holds its tail over rather than leave a gap.
+  struct frame_run_s run;
+  while (frame_ring_size(&pthis->video_input->ring) < FRAME_RING_SIZE &&
+         !frame_buffer_get_next_run(pthis->video_buffer, &run))
+  {
+    mixer_input_push_run(pthis->video_input, &run);
   }
 }
 
 char archive_mixer_has_next(struct archive_mixer_s* pthis) {
-  char ret = 0;
-  uv_mutex_lock(&pthis->queue_lock);
-  // Pop any and all data in the mixer.
-  ret = !pthis->audio_frame_queue.empty() || !pthis->video_frame_queue.empty();
-  // Don't pop until both queues are populated
-  //ret = !pthis->audio_frame_queue.empty() && !pthis->video_frame_queue.empty();
-  
-  // EXPERIMENT: buffer a bunch of data to try and relieve interleaving pressure
-  // on the RTMP output.
-  //ret = pthis->audio_frame_queue.size() > 100 && pthis->video_frame_queue.size() > 60;
-  uv_mutex_unlock(&pthis->queue_lock);
-  return ret;
+  merge_heap_refill(pthis);
+  return pthis->merge_heap_size && merge_root_is_ready(pthis);
 }
 
 int archive_mixer_get_next(struct archive_mixer_s* pthis, AVFrame** frame_out,
                            enum AVMediaType* media_type)
 {
-  int ret = 0;
-  ret = frame_queue_pop_safe(pthis, frame_out, media_type);
-  return ret;
+  return frame_queue_pop(pthis, frame_out, media_type);
 }
 
 size_t archive_mixer_get_size(struct archive_mixer_s* pthis) {
-  return pthis->video_size_estimated + pthis->audio_size_estimated;
+  size_t size = 0;
+  for (int i = 0; i < pthis->num_inputs; i++) {
+    size += frame_ring_size(&pthis->inputs[i].ring);
+  }
+  return size;
 }
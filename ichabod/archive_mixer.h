@@ -15,19 +15,29 @@
 /**
  * multi-format mixer generates archive media from horseman data pipe.
  * Inputs are:
- * 1) base64-encoded images with timestamps
- * 2) webm file paths that continuously grow and contain audio needing mixdown
+ * 1) decoded screencast images with timestamps
+ * 2) captured audio needing mixdown
  *
  * Outputs:
- * 1) Constant frame rate video
+ * 1) Constant frame rate video, or variable frame rate if configured
  * 2) Audio mixdown from multiple sources
  */
 struct archive_mixer_s;
 
 struct archive_mixer_config_s {
   double initial_timestamp;
+  // Latency target, in seconds. A frame is held until every stream that has
+  // started has caught up to it, so the output interleaves in order, but
+  // never longer than this. Zero releases frames as they arrive.
   double min_buffer_time;
   double video_fps_out;
+  // Pass each video frame through once, at its own timestamp, instead of
+  // repeating frames to fill a video_fps_out grid. Needs a container that
+  // takes variable frame rate, such as MP4 or MKV.
+  char variable_frame_rate;
+  // Variable frame rate only: seconds before the last frame is repeated, if
+  // nothing new arrives. Zero never repeats.
+  double max_frame_interval;
   AVFormatContext* format_out;
   AVCodecContext* audio_ctx_out;
   AVStream* audio_stream_out;
@@ -43,10 +53,12 @@ void archive_mixer_free(struct archive_mixer_s* mixer);
 void archive_mixer_drain_audio(struct archive_mixer_s* mixer);
 void archive_mixer_consume_video(struct archive_mixer_s* mixer,
                                  AVFrame* frame, double timestamp);
+// a frame is ready to be released. frames may be held while this is false.
 char archive_mixer_has_next(struct archive_mixer_s* mixer);
 int archive_mixer_get_next(struct archive_mixer_s* mixer, AVFrame** frame_out,
                            enum AVMediaType* media_type);
-// (non locking) estimated number of frames remaining on the mixer
+// (non locking) estimated number of frames remaining on the mixer. a frame
+// and its queued repeats count once.
 size_t archive_mixer_get_size(struct archive_mixer_s* mixer);
 
 #endif /* archive_mixer_h */
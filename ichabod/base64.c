@@ -86,72 +86,306 @@ unsigned char * base64_encode(const unsigned char *src, size_t len,
 }
 
 
+/* base64_table, inverted. 0x80 marks characters outside the alphabet. */
+static const unsigned char base64_dtable[256] = {
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x3e, 0x80, 0x80, 0x80, 0x3f,
+  0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x80, 0x80, 0x80, 0x00, 0x80, 0x80,
+  0x80, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+  0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+};
+
+/*
+ * Vector decoders. Each one decodes whole blocks of alphabet characters
+ * from the start of in and returns how many input characters it consumed,
+ * always a multiple of 4. It stops at the first block containing anything
+ * else (padding, whitespace) and leaves that to the scalar decoder.
+ *
+ * Stores are wider than the bytes they produce, so blocks are only taken
+ * while plenty of input remains; that keeps every store inside an output
+ * buffer of BASE64_DECODED_MAX(len) bytes. Each block is loaded before
+ * anything is stored, so out may be the input buffer itself.
+ */
+typedef size_t (*base64_blocks_fn)(const unsigned char *in, size_t len,
+                                   unsigned char *out);
+
+static size_t base64_blocks_none(const unsigned char *in, size_t len,
+                                 unsigned char *out)
+{
+  return 0;
+}
+
+#ifdef __SSE2__
+#include <x86intrin.h>
+
+/*
+ * Character classification by high nibble, after Wojciech Mula's pshufb
+ * base64 decoder. Within each high nibble the alphabet is one contiguous
+ * range, except for '/', which is matched on its own.
+ */
+#define BASE64_LOWER_BOUNDS \
+  1, 1, 0x2b, 0x30, 0x41, 0x50, 0x61, 0x70, 1, 1, 1, 1, 1, 1, 1, 1
+#define BASE64_UPPER_BOUNDS \
+  0, 0, 0x2b, 0x39, 0x4f, 0x5a, 0x6f, 0x7a, 0, 0, 0, 0, 0, 0, 0, 0
+#define BASE64_SHIFTS \
+  0, 0, 0x3e - 0x2b, 0x34 - 0x30, 0x00 - 0x41, 0x0f - 0x50, \
+  0x1a - 0x61, 0x29 - 0x70, 0, 0, 0, 0, 0, 0, 0, 0
+
+__attribute__((target("ssse3")))
+static size_t base64_blocks_ssse3(const unsigned char *in, size_t len,
+                                  unsigned char *out)
+{
+  const __m128i lower_lut = _mm_setr_epi8(BASE64_LOWER_BOUNDS);
+  const __m128i upper_lut = _mm_setr_epi8(BASE64_UPPER_BOUNDS);
+  const __m128i shift_lut = _mm_setr_epi8(BASE64_SHIFTS);
+  const __m128i slash = _mm_set1_epi8(0x2f);
+  const __m128i nibble_mask = _mm_set1_epi8(0x0f);
+  const __m128i pack_pairs = _mm_set1_epi32(0x01400140);
+  const __m128i pack_quads = _mm_set1_epi32(0x00011000);
+  const __m128i pack_bytes = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                           14, 13, 12, -1, -1, -1, -1);
+  size_t done = 0;
+
+  while (len - done >= 32) {
+    __m128i src = _mm_loadu_si128((const __m128i *) (in + done));
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(src, 4), nibble_mask);
+    __m128i is_slash = _mm_cmpeq_epi8(src, slash);
+    __m128i outside = _mm_or_si128(
+      _mm_cmplt_epi8(src, _mm_shuffle_epi8(lower_lut, hi)),
+      _mm_cmpgt_epi8(src, _mm_shuffle_epi8(upper_lut, hi)));
+    if (_mm_movemask_epi8(_mm_andnot_si128(is_slash, outside)))
+      break;
+
+    /* '/' lands 3 past its value with the shift for its nibble */
+    __m128i sextets = _mm_add_epi8(src, _mm_shuffle_epi8(shift_lut, hi));
+    sextets = _mm_add_epi8(sextets,
+                           _mm_and_si128(is_slash, _mm_set1_epi8(-3)));
+    __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(sextets, pack_pairs),
+                                    pack_quads);
+    _mm_storeu_si128((__m128i *) (out + done / 4 * 3),
+                     _mm_shuffle_epi8(merged, pack_bytes));
+    done += 16;
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static size_t base64_blocks_avx2(const unsigned char *in, size_t len,
+                                 unsigned char *out)
+{
+  const __m256i lower_lut = _mm256_setr_epi8(BASE64_LOWER_BOUNDS,
+                                             BASE64_LOWER_BOUNDS);
+  const __m256i upper_lut = _mm256_setr_epi8(BASE64_UPPER_BOUNDS,
+                                             BASE64_UPPER_BOUNDS);
+  const __m256i shift_lut = _mm256_setr_epi8(BASE64_SHIFTS, BASE64_SHIFTS);
+  const __m256i slash = _mm256_set1_epi8(0x2f);
+  const __m256i nibble_mask = _mm256_set1_epi8(0x0f);
+  const __m256i pack_pairs = _mm256_set1_epi32(0x01400140);
+  const __m256i pack_quads = _mm256_set1_epi32(0x00011000);
+  const __m256i pack_bytes = _mm256_setr_epi8(
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+  size_t done = 0;
+
+  while (len - done >= 64) {
+    __m256i src = _mm256_loadu_si256((const __m256i *) (in + done));
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(src, 4), nibble_mask);
+    __m256i is_slash = _mm256_cmpeq_epi8(src, slash);
+    __m256i outside = _mm256_or_si256(
+      _mm256_cmpgt_epi8(_mm256_shuffle_epi8(lower_lut, hi), src),
+      _mm256_cmpgt_epi8(src, _mm256_shuffle_epi8(upper_lut, hi)));
+    if (_mm256_movemask_epi8(_mm256_andnot_si256(is_slash, outside)))
+      break;
+
+    __m256i sextets = _mm256_add_epi8(src,
+                                      _mm256_shuffle_epi8(shift_lut, hi));
+    sextets = _mm256_add_epi8(sextets,
+                              _mm256_and_si256(is_slash,
+                                               _mm256_set1_epi8(-3)));
+    __m256i merged = _mm256_madd_epi16(
+      _mm256_maddubs_epi16(sextets, pack_pairs), pack_quads);
+    merged = _mm256_shuffle_epi8(merged, pack_bytes);
+    _mm256_storeu_si256((__m256i *) (out + done / 4 * 3),
+                        _mm256_permutevar8x32_epi32(merged, pack_lanes));
+    done += 32;
+  }
+  return done;
+}
+#endif /* __SSE2__ */
+
+static base64_blocks_fn base64_blocks_select(void)
+{
+#ifdef __SSE2__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return base64_blocks_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return base64_blocks_ssse3;
+#endif
+  return base64_blocks_none;
+}
+
+/* scalar decoding runs at least this far before vectors are tried again */
+#define BASE64_VECTOR_RETRY 64
+
 /**
- * base64_decode - Base64 decode
+ * base64_decoder_init - Start an incremental Base64 decode
+ * @dec: Decoder state
+ */
+void base64_decoder_init(struct base64_decoder_s *dec)
+{
+  memset(dec, 0, sizeof(*dec));
+}
+
+/**
+ * base64_decoder_update - Decode the next piece of Base64 text
+ * @dec: Decoder state
  * @src: Data to be decoded
  * @len: Length of the data to be decoded
- * @out_len: Pointer to output length variable
- * Returns: Allocated buffer of out_len bytes of decoded data,
- * or %NULL on failure
+ * @out: Output buffer, at least BASE64_DECODED_MAX(len) bytes
+ * Returns: Number of bytes written to out
  *
- * Caller is responsible for freeing the returned buffer.
+ * Pieces may be split anywhere; characters left over from an incomplete
+ * block are carried into the next call. Characters outside the base64
+ * alphabet are skipped, wherever they are. out may be src only on the first
+ * call after base64_decoder_init, when nothing is carried over.
  */
-unsigned char * base64_decode(const unsigned char *src, size_t len,
-                              size_t *out_len)
+size_t base64_decoder_update(struct base64_decoder_s *dec,
+                             const unsigned char *src, size_t len,
+                             unsigned char *out)
 {
-  unsigned char dtable[256], *out, *pos, block[4], tmp;
-  size_t i, count, olen;
-  int pad = 0;
-
-  memset(dtable, 0x80, 256);
-  for (i = 0; i < sizeof(base64_table) - 1; i++)
-    dtable[base64_table[i]] = (unsigned char) i;
-  dtable['='] = 0;
-
-  count = 0;
-  for (i = 0; i < len; i++) {
-    if (dtable[src[i]] != 0x80)
-      count++;
-  }
+  /* every thread picks the same decoder, so a race here is harmless */
+  static base64_blocks_fn blocks = NULL;
+  base64_blocks_fn fn = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+  const unsigned char *in, *end, *retry;
+  unsigned char *pos, tmp;
+  size_t n;
 
-  if (count == 0 || count % 4)
-    return NULL;
+  if (!fn) {
+    fn = base64_blocks_select();
+    __atomic_store_n(&blocks, fn, __ATOMIC_RELAXED);
+  }
 
-  olen = count / 4 * 3;
-  pos = out = malloc(olen);
-  if (out == NULL)
-    return NULL;
+  in = retry = src;
+  end = src + len;
+  pos = out;
+  while (in < end && !dec->is_done) {
+    if (dec->count == 0 && in >= retry) {
+      n = fn(in, end - in, pos);
+      in += n;
+      pos += n / 4 * 3;
+      dec->valid += n;
+      retry = in + BASE64_VECTOR_RETRY;
+      if (in == end)
+        break;
+    }
 
-  count = 0;
-  for (i = 0; i < len; i++) {
-    tmp = dtable[src[i]];
-    if (tmp == 0x80)
+    tmp = base64_dtable[*in];
+    if (tmp == 0x80) {
+      in++;
       continue;
+    }
 
-    if (src[i] == '=')
-      pad++;
-    block[count] = tmp;
-    count++;
-    if (count == 4) {
-      *pos++ = (block[0] << 2) | (block[1] >> 4);
-      *pos++ = (block[1] << 4) | (block[2] >> 2);
-      *pos++ = (block[2] << 6) | block[3];
-      count = 0;
-      if (pad) {
-        if (pad == 1)
+    if (*in == '=')
+      dec->pad++;
+    in++;
+    dec->valid++;
+    dec->block[dec->count] = tmp;
+    dec->count++;
+    if (dec->count == 4) {
+      *pos++ = (dec->block[0] << 2) | (dec->block[1] >> 4);
+      *pos++ = (dec->block[1] << 4) | (dec->block[2] >> 2);
+      *pos++ = (dec->block[2] << 6) | dec->block[3];
+      dec->count = 0;
+      if (dec->pad) {
+        if (dec->pad == 1)
           pos--;
-        else if (pad == 2)
+        else if (dec->pad == 2)
           pos -= 2;
         else {
           /* Invalid padding */
-          free(out);
-          return NULL;
+          dec->is_bad = 1;
+          pos -= 3;
         }
-        break;
+        dec->is_done = 1;
       }
     }
   }
-  
-  *out_len = pos - out;
+
+  /* anything after the padding still has to add up to whole blocks */
+  for (; in < end; in++) {
+    if (base64_dtable[*in] != 0x80)
+      dec->valid++;
+  }
+
+  return pos - out;
+}
+
+/**
+ * base64_decoder_finish - Check a finished incremental Base64 decode
+ * @dec: Decoder state
+ * Returns: 0 if all the text passed in was valid Base64, -1 if not
+ */
+int base64_decoder_finish(struct base64_decoder_s *dec)
+{
+  if (dec->is_bad || dec->valid == 0 || dec->valid % 4)
+    return -1;
+  return 0;
+}
+
+/**
+ * base64_decode_to - Base64 decode into a caller provided buffer
+ * @src: Data to be decoded
+ * @len: Length of the data to be decoded
+ * @out: Output buffer, at least BASE64_DECODED_MAX(len) bytes. May be src,
+ * to decode in place.
+ * @out_len: Pointer to output length variable
+ * Returns: 0 on success, -1 on failure
+ */
+int base64_decode_to(const unsigned char *src, size_t len,
+                     unsigned char *out, size_t *out_len)
+{
+  struct base64_decoder_s dec;
+
+  base64_decoder_init(&dec);
+  *out_len = base64_decoder_update(&dec, src, len, out);
+  return base64_decoder_finish(&dec);
+}
+
+/**
+ * base64_decode - Base64 decode
+ * @src: Data to be decoded
+ * @len: Length of the data to be decoded
+ * @out_len: Pointer to output length variable
+ * Returns: Allocated buffer of out_len bytes of decoded data,
+ * or %NULL on failure
+ *
+ * Caller is responsible for freeing the returned buffer.
+ */
+unsigned char * base64_decode(const unsigned char *src, size_t len,
+                              size_t *out_len)
+{
+  unsigned char *out;
+
+  out = malloc(BASE64_DECODED_MAX(len));
+  if (out == NULL)
+    return NULL;
+
+  if (base64_decode_to(src, len, out, out_len)) {
+    free(out);
+    return NULL;
+  }
   return out;
 }
@@ -9,9 +9,30 @@
 #ifndef BASE64_H
 #define BASE64_H
 
+/* Upper bound on the decoded size of len bytes of base64 text */
+#define BASE64_DECODED_MAX(len) ((len) / 4 * 3 + 3)
+
+/* Incremental decode state. See base64_decoder_update(). */
+struct base64_decoder_s {
+  unsigned char block[4];
+  size_t count; /* characters in block */
+  size_t valid; /* alphabet characters seen, padding included */
+  int pad;
+  char is_done; /* padding seen; the rest is only counted */
+  char is_bad;
+};
+
 unsigned char * base64_encode(const unsigned char *src, size_t len,
                               size_t *out_len);
 unsigned char * base64_decode(const unsigned char *src, size_t len,
                               size_t *out_len);
+int base64_decode_to(const unsigned char *src, size_t len,
+                     unsigned char *out, size_t *out_len);
+
+void base64_decoder_init(struct base64_decoder_s *dec);
+size_t base64_decoder_update(struct base64_decoder_s *dec,
+                             const unsigned char *src, size_t len,
+                             unsigned char *out);
+int base64_decoder_finish(struct base64_decoder_s *dec);
 
 #endif /* BASE64_H */
@@ -0,0 +1,475 @@
+//
+//  blob_audio_source.cc
+//  ichabod
+//
+//  Created by Charley Robinson on 7/11/17.
+//
+
+extern "C" {
+#include <assert.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <string.h>
+#include <uv.h>
+#include "blob_audio_source.h"
+#include "resampler.h"
+}
+
+#include <map>
+#include <queue>
+#include <string>
+
+// Workaround C++ issue with ffmpeg macro
+#ifndef __clang__
+#undef av_err2str
+#define av_err2str(errnum) \
+av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), \
+AV_ERROR_MAX_STRING_SIZE, errnum)
+#endif
+
+#define BLOB_AUDIO_SAMPLE_RATE 48000
+#define BLOB_AUDIO_IO_BUFFER_SIZE 4096
+// a few seconds of 20ms opus frames
+#define BLOB_AUDIO_DEFAULT_MAX_QUEUED_FRAMES 250
+
+struct blob_stream_s {
+  struct blob_audio_s* parent;
+  std::string subscriber_id;
+  uv_thread_t worker_thread;
+
+  // Chunks not yet read by the demuxer. Guarded by data_lock.
+  uv_mutex_t data_lock;
+  uv_cond_t data_cond;
+  std::queue<std::string> chunks;
+  size_t chunk_offset;
+  char is_eof;
+  // Set by the worker once it is done with the stream, for good or ill.
+  char is_finished;
+
+  AVIOContext* avio_context;
+  AVFormatContext* format_context;
+  AVCodecContext* codec_context;
+  AVCodec* codec;
+  int stream_index;
+  AVStream* stream;
+  struct resampler_s* resampler;
+  int64_t corrected_pts;
+
+  // Decoded frames for this subscriber. Guarded by queue_lock.
+  uv_mutex_t queue_lock;
+  std::queue<AVFrame*> frames;
+};
+
+struct blob_audio_s {
+  // Written by the horseman loop only; lookups from other threads hold
+  // streams_lock.
+  uv_mutex_t streams_lock;
+  std::map<std::string, struct blob_stream_s*> streams;
+  int max_queued_frames;
+  int64_t dropped_count;
+
+  void (*on_audio_data)(struct blob_audio_s* source,
+                        const char* subscriber_id, void* p);
+  void* audio_data_cb_p;
+};
+
+#pragma mark - Custom IO
+
+// AVIOContext read callback. Blocks the stream worker until the horseman
+// delivers more of the stream, or the stream is ended.
+static int read_blob_data(void* opaque, uint8_t* buf, int buf_size) {
+  struct blob_stream_s* stream = (struct blob_stream_s*)opaque;
+  int size = 0;
+  uv_mutex_lock(&stream->data_lock);
+  while (stream->chunks.empty() && !stream->is_eof) {
+    uv_cond_wait(&stream->data_cond, &stream->data_lock);
+  }
+  while (size < buf_size && !stream->chunks.empty()) {
+    std::string& chunk = stream->chunks.front();
+    size_t available = chunk.size() - stream->chunk_offset;
+    size_t length = buf_size - size;
+    if (available < length) {
+      length = available;
+    }
+    memcpy(buf + size, chunk.data() + stream->chunk_offset, length);
+    size += length;
+    stream->chunk_offset += length;
+    if (stream->chunk_offset == chunk.size()) {
+      stream->chunks.pop();
+      stream->chunk_offset = 0;
+    }
+  }
+  uv_mutex_unlock(&stream->data_lock);
+  return size ? size : AVERROR_EOF;
+}
+
+#pragma mark - Stream worker
+
+static int open_blob_stream(struct blob_stream_s* stream) {
+  int ret;
+  uint8_t* io_buffer = (uint8_t*)av_malloc(BLOB_AUDIO_IO_BUFFER_SIZE);
+  stream->avio_context =
+  avio_alloc_context(io_buffer, BLOB_AUDIO_IO_BUFFER_SIZE, 0, stream,
+                     read_blob_data, NULL, NULL);
+  stream->format_context = avformat_alloc_context();
+  stream->format_context->pb = stream->avio_context;
+  stream->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+  // MediaRecorder only gives us WebM. Naming the demuxer skips probing,
+  // which would otherwise sit waiting on a probe-sized prefix of the stream.
+  ret = avformat_open_input(&stream->format_context, NULL,
+                            av_find_input_format("matroska"), NULL);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot open blob stream %s: %s\n",
+           stream->subscriber_id.c_str(), av_err2str(ret));
+    return ret;
+  }
+
+  ret = av_find_best_stream(stream->format_context,
+                            AVMEDIA_TYPE_AUDIO,
+                            -1, -1,
+                            &stream->codec, 0);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR,
+           "Cannot find an audio stream in blob stream %s\n",
+           stream->subscriber_id.c_str());
+    return ret;
+  }
+  stream->stream_index = ret;
+  stream->stream = stream->format_context->streams[stream->stream_index];
+  // prefer libopus over built-in opus
+  if (AV_CODEC_ID_OPUS == stream->codec->id &&
+      strcmp("libopus", stream->codec->name))
+  {
+    AVCodec* libopus = avcodec_find_decoder_by_name("libopus");
+    if (libopus) {
+      stream->codec = libopus;
+    }
+  }
+
+  stream->codec_context = avcodec_alloc_context3(stream->codec);
+  ret = avcodec_parameters_to_context(stream->codec_context,
+                                      stream->stream->codecpar);
+  if (ret < 0) {
+    printf("Failed to copy stream codec parameters to codec context\n");
+    return ret;
+  }
+  av_opt_set_int(stream->codec_context, "refcounted_frames", 1, 0);
+  stream->codec_context->request_sample_fmt = AV_SAMPLE_FMT_S16;
+
+  ret = avcodec_open2(stream->codec_context, stream->codec, NULL);
+  if (ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "Cannot open audio decoder\n");
+    return ret;
+  }
+
+  if (!stream->codec_context->channel_layout) {
+    stream->codec_context->channel_layout =
+    av_get_default_channel_layout(stream->codec_context->channels);
+  }
+  struct resampler_config_s config;
+  config.channel_layout_in = stream->codec_context->channel_layout;
+  config.channel_layout_out = AV_CH_LAYOUT_STEREO;
+  config.format_in = stream->codec_context->sample_fmt;
+  config.format_out = AV_SAMPLE_FMT_FLTP;
+  config.sample_rate_in = stream->codec_context->sample_rate;
+  config.sample_rate_out = BLOB_AUDIO_SAMPLE_RATE;
+  config.nb_channels_in = stream->codec_context->channels;
+  config.nb_channels_out = 2;
+  return resampler_load_config(stream->resampler, &config);
+}
+
+// Chrome's MediaRecorder webms carry bad PTS values. Trust the first one and
+// count samples from there.
+static void repair_frame_pts(struct blob_stream_s* stream, AVFrame* frame) {
+  AVRational sample_time_base = { 1, frame->sample_rate };
+  int64_t original_pts = av_rescale_q(frame->pts, stream->stream->time_base,
+                                      sample_time_base);
+  if (stream->corrected_pts < 0) {
+    stream->corrected_pts = original_pts;
+  }
+  frame->pts = stream->corrected_pts;
+  stream->corrected_pts += frame->nb_samples;
+  if (llabs(frame->pts - original_pts) > frame->sample_rate / 100) {
+    printf("blob audio %s: WARNING drifting audio PTS values "
+           "(%" PRId64 " vs %" PRId64 ")\n", stream->subscriber_id.c_str(),
+           frame->pts, original_pts);
+  }
+}
+
+static void queue_push(struct blob_stream_s* stream, AVFrame* frame) {
+  struct blob_audio_s* pthis = stream->parent;
+  AVFrame* dropped = NULL;
+  uv_mutex_lock(&stream->queue_lock);
+  stream->frames.push(frame);
+  if (stream->frames.size() > (size_t)pthis->max_queued_frames) {
+    dropped = stream->frames.front();
+    stream->frames.pop();
+  }
+  uv_mutex_unlock(&stream->queue_lock);
+  if (dropped) {
+    __atomic_add_fetch(&pthis->dropped_count, 1, __ATOMIC_SEQ_CST);
+    av_frame_free(&dropped);
+  }
+}
+
+static int read_stream_frame(struct blob_stream_s* stream, AVFrame** frame_out)
+{
+  int ret, got_frame = 0;
+  AVPacket packet = { 0 };
+  *frame_out = NULL;
+
+  while (!got_frame) {
+    ret = av_read_frame(stream->format_context, &packet);
+    if (ret < 0) {
+      return ret;
+    }
+
+    if (packet.stream_index == stream->stream_index) {
+      AVFrame* frame = av_frame_alloc();
+      ret = avcodec_decode_audio4(stream->codec_context, frame,
+                                  &got_frame, &packet);
+      if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Error decoding audio: %s\n",
+               av_err2str(ret));
+      }
+      if (got_frame) {
+        frame->pts = av_frame_get_best_effort_timestamp(frame);
+        *frame_out = frame;
+      } else {
+        av_frame_free(&frame);
+      }
+    }
+
+    av_packet_unref(&packet);
+  }
+
+  return 0;
+}
+
+static void blob_stream_main(void* p) {
+  struct blob_stream_s* stream = (struct blob_stream_s*)p;
+  struct blob_audio_s* pthis = stream->parent;
+  int ret = open_blob_stream(stream);
+  while (!ret) {
+    AVFrame* frame = NULL;
+    AVFrame* resampled_frame = NULL;
+    ret = read_stream_frame(stream, &frame);
+    if (ret || !frame) {
+      break;
+    }
+    repair_frame_pts(stream, frame);
+    int64_t pts = frame->pts;
+    int convert_ret = resampler_convert(stream->resampler, frame,
+                                        &resampled_frame);
+    av_frame_free(&frame);
+    if (convert_ret) {
+      continue;
+    }
+    resampled_frame->pts = pts;
+    queue_push(stream, resampled_frame);
+    pthis->on_audio_data(pthis, stream->subscriber_id.c_str(),
+                         pthis->audio_data_cb_p);
+  }
+  if (AVERROR_EOF != ret) {
+    printf("blob audio %s: stream ended early: %s\n",
+           stream->subscriber_id.c_str(), av_err2str(ret));
+  }
+  // Whatever the demuxer has not read yet is of no use to anyone now. Further
+  // chunks are discarded, unless they start a new recording.
+  uv_mutex_lock(&stream->data_lock);
+  stream->chunks = std::queue<std::string>();
+  stream->chunk_offset = 0;
+  stream->is_eof = 1;
+  stream->is_finished = 1;
+  uv_mutex_unlock(&stream->data_lock);
+}
+
+static struct blob_stream_s* blob_stream_create(struct blob_audio_s* pthis,
+                                                const char* subscriber_id)
+{
+  struct blob_stream_s* stream = new blob_stream_s();
+  stream->parent = pthis;
+  stream->subscriber_id = subscriber_id;
+  stream->corrected_pts = -1;
+  uv_mutex_init(&stream->data_lock);
+  uv_mutex_init(&stream->queue_lock);
+  uv_cond_init(&stream->data_cond);
+  resampler_alloc(&stream->resampler);
+  int ret = uv_thread_create(&stream->worker_thread, blob_stream_main, stream);
+  assert(!ret);
+  printf("blob audio: new stream for subscriber %s\n", subscriber_id);
+  return stream;
+}
+
+static void blob_stream_end(struct blob_stream_s* stream) {
+  uv_mutex_lock(&stream->data_lock);
+  stream->is_eof = 1;
+  uv_cond_signal(&stream->data_cond);
+  uv_mutex_unlock(&stream->data_lock);
+}
+
+// stream must have been ended first
+static void blob_stream_free(struct blob_stream_s* stream) {
+  uv_thread_join(&stream->worker_thread);
+  avcodec_free_context(&stream->codec_context);
+  avformat_close_input(&stream->format_context);
+  // custom IO is not ours to close through the format context
+  if (stream->avio_context) {
+    av_freep(&stream->avio_context->buffer);
+    av_freep(&stream->avio_context);
+  }
+  resampler_free(stream->resampler);
+  while (!stream->frames.empty()) {
+    AVFrame* frame = stream->frames.front();
+    stream->frames.pop();
+    av_frame_free(&frame);
+  }
+  uv_mutex_destroy(&stream->queue_lock);
+  uv_cond_destroy(&stream->data_cond);
+  uv_mutex_destroy(&stream->data_lock);
+  delete stream;
+}
+
+#pragma mark - Public API
+
+void blob_audio_alloc(struct blob_audio_s** source_out) {
+  struct blob_audio_s* pthis = new blob_audio_s();
+  uv_mutex_init(&pthis->streams_lock);
+  pthis->max_queued_frames = BLOB_AUDIO_DEFAULT_MAX_QUEUED_FRAMES;
+  *source_out = pthis;
+}
+
+void blob_audio_free(struct blob_audio_s* pthis) {
+  blob_audio_stop(pthis);
+  uv_mutex_destroy(&pthis->streams_lock);
+  delete pthis;
+}
+
+void blob_audio_load_config(struct blob_audio_s* pthis,
+                            struct blob_audio_config_s* config)
+{
+  pthis->on_audio_data = config->on_audio_data;
+  pthis->audio_data_cb_p = config->audio_data_cb_p;
+  if (config->max_queued_frames > 0) {
+    pthis->max_queued_frames = config->max_queued_frames;
+  }
+}
+
+static char blob_stream_is_finished(struct blob_stream_s* stream) {
+  uv_mutex_lock(&stream->data_lock);
+  char ret = stream->is_finished;
+  uv_mutex_unlock(&stream->data_lock);
+  return ret;
+}
+
+// A new recording starts with an EBML header.
+static char is_webm_header(const uint8_t* data, size_t length) {
+  static const uint8_t ebml_magic[] = { 0x1a, 0x45, 0xdf, 0xa3 };
+  return length >= sizeof(ebml_magic) &&
+      !memcmp(data, ebml_magic, sizeof(ebml_magic));
+}
+
+// Called from a single thread (the horseman loop) only.
+int blob_audio_consume(struct blob_audio_s* pthis, const char* subscriber_id,
+                       const uint8_t* data, size_t length)
+{
+  if (!subscriber_id || !data || !length) {
+    return EINVAL;
+  }
+  // Without a consumer, decoding (or even demuxing) would be wasted work.
+  if (!pthis->on_audio_data) {
+    return 0;
+  }
+  struct blob_stream_s* stream = NULL;
+  auto it = pthis->streams.find(subscriber_id);
+  if (it != pthis->streams.end()) {
+    stream = it->second;
+    if (blob_stream_is_finished(stream) && is_webm_header(data, length)) {
+      // The subscriber started over (e.g. after a reconnect). Its old worker
+      // has returned already, so the join below does not block.
+      printf("blob audio: restarting stream for subscriber %s\n",
+             subscriber_id);
+      uv_mutex_lock(&pthis->streams_lock);
+      pthis->streams.erase(it);
+      uv_mutex_unlock(&pthis->streams_lock);
+      blob_stream_free(stream);
+      stream = NULL;
+    }
+  }
+  if (!stream) {
+    stream = blob_stream_create(pthis, subscriber_id);
+    uv_mutex_lock(&pthis->streams_lock);
+    pthis->streams[subscriber_id] = stream;
+    uv_mutex_unlock(&pthis->streams_lock);
+  }
+  uv_mutex_lock(&stream->data_lock);
+  if (!stream->is_eof) {
+    stream->chunks.push(std::string((const char*)data, length));
+    uv_cond_signal(&stream->data_cond);
+  }
+  uv_mutex_unlock(&stream->data_lock);
+  return 0;
+}
+
+void blob_audio_stop(struct blob_audio_s* pthis) {
+  // Take the streams out of sight of consumers before tearing them down.
+  std::map<std::string, struct blob_stream_s*> streams;
+  uv_mutex_lock(&pthis->streams_lock);
+  streams.swap(pthis->streams);
+  uv_mutex_unlock(&pthis->streams_lock);
+  for (auto it = streams.begin(); it != streams.end(); it++) {
+    blob_stream_end(it->second);
+  }
+  for (auto it = streams.begin(); it != streams.end(); it++) {
+    blob_stream_free(it->second);
+  }
+}
+
+char blob_audio_has_next(struct blob_audio_s* pthis,
+                         const char* subscriber_id)
+{
+  char ret = 0;
+  uv_mutex_lock(&pthis->streams_lock);
+  auto it = pthis->streams.find(subscriber_id);
+  if (it != pthis->streams.end()) {
+    struct blob_stream_s* stream = it->second;
+    uv_mutex_lock(&stream->queue_lock);
+    ret = stream->frames.size() > 0;
+    uv_mutex_unlock(&stream->queue_lock);
+  }
+  uv_mutex_unlock(&pthis->streams_lock);
+  return ret;
+}
+
+int blob_audio_get_next(struct blob_audio_s* pthis,
+                        const char* subscriber_id, AVFrame** frame_out)
+{
+  AVFrame* frame = NULL;
+  int ret = EAGAIN;
+  uv_mutex_lock(&pthis->streams_lock);
+  auto it = pthis->streams.find(subscriber_id);
+  if (it != pthis->streams.end()) {
+    struct blob_stream_s* stream = it->second;
+    uv_mutex_lock(&stream->queue_lock);
+    if (!stream->frames.empty()) {
+      frame = stream->frames.front();
+      stream->frames.pop();
+      ret = 0;
+    }
+    uv_mutex_unlock(&stream->queue_lock);
+  }
+  uv_mutex_unlock(&pthis->streams_lock);
+  *frame_out = frame;
+  return ret;
+}
+
+AVRational blob_audio_get_time_base(struct blob_audio_s* pthis) {
+  AVRational time_base = { 1, BLOB_AUDIO_SAMPLE_RATE };
+  return time_base;
+}
+
+int64_t blob_audio_get_dropped_count(struct blob_audio_s* pthis) {
+  return __atomic_load_n(&pthis->dropped_count, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,64 @@
+//
+//  blob_audio_source.h
+//  ichabod
+//
+//  Created by Charley Robinson on 7/11/17.
+//
+
+#ifndef blob_audio_source_h
+#define blob_audio_source_h
+
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+
+/**
+ * Audio decoded from WebM chunks (as produced by MediaRecorder) that arrive
+ * over the horseman blobsink, one stream per subscriber. Chunks are fed to
+ * each subscriber's demuxer from memory, so nothing is written to disk.
+ *
+ * Every stream decodes on its own thread. Without a consumer (on_audio_data)
+ * chunks are ignored and no streams are created. Each stream keeps its own
+ * queue of output frames, read by subscriber id. Output frames are planar float, stereo,
+ * 48kHz, with pts counted in samples from the start of that subscriber's
+ * recording.
+ */
+struct blob_audio_s;
+
+struct blob_audio_config_s {
+  // notify when new data hits a subscriber's queue. runs on that stream's
+  // worker thread. Without it, chunks are ignored.
+  void (*on_audio_data)(struct blob_audio_s* source,
+                        const char* subscriber_id, void* p);
+  void* audio_data_cb_p;
+  // Decoded frames held for the consumer, per subscriber. Past this, the
+  // oldest are discarded. Zero picks a default.
+  int max_queued_frames;
+};
+
+void blob_audio_alloc(struct blob_audio_s** source_out);
+void blob_audio_free(struct blob_audio_s* source);
+void blob_audio_load_config(struct blob_audio_s* source,
+                            struct blob_audio_config_s* config);
+
+/** Append a chunk of a subscriber's stream. The data is copied. A stream (and
+ * its worker thread) is created for subscriber ids not seen before, and
+ * recreated when a stream that has ended receives a new WebM header.
+ */
+int blob_audio_consume(struct blob_audio_s* source, const char* subscriber_id,
+                       const uint8_t* data, size_t length);
+/** End all streams and join the workers. Chunks already received are still
+ * decoded (and announced through on_audio_data) before the workers return;
+ * after that, queued frames are discarded. */
+void blob_audio_stop(struct blob_audio_s* source);
+
+char blob_audio_has_next(struct blob_audio_s* source,
+                         const char* subscriber_id);
+/** Caller is responsible for freeing frame_out */
+int blob_audio_get_next(struct blob_audio_s* source,
+                        const char* subscriber_id, AVFrame** frame_out);
+AVRational blob_audio_get_time_base(struct blob_audio_s* source);
+/** Frames discarded because nobody drained a queue in time, over all
+ * subscribers. */
+int64_t blob_audio_get_dropped_count(struct blob_audio_s* source);
+
+#endif /* blob_audio_source_h */
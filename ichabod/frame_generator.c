@@ -6,70 +6,1331 @@
 //
 
 #include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #include "frame_generator.h"
 #include "base64.h"
 #include "yuv_rgb.h"
-#include "growing_file_audio_source.h"
-#include "audio_mixer.h"
+#include "slice_pool.h"
 
 #include <libavutil/channel_layout.h>
+#include <libavutil/common.h>
 #include <MagickWand/MagickWand.h>
 #include <MagickWand/magick-image.h>
+#include <libavutil/imgutils.h>
+#include <png.h>
+#include <jpeglib.h>
+#ifdef __SSE2__
+#include <x86intrin.h>
+#endif
 
-#define RGB_BYTES_PER_PIXEL 3
+// widest vector the converters use
+#define FRAME_LINESIZE_ALIGN 32
+// slack after the last plane, for SIMD readers that overshoot a row
+#define FRAME_BUFFER_PADDING 64
+// resolutions kept warm at once. screencasts rarely change size.
+#define FRAME_POOL_MAX 4
+// unit of change detection. a whole number of 4:2:0 chroma blocks.
+#define TILE_SIZE 16
+// color space of every frame converted from RGB
+#define FRAME_YUV_TYPE YCBCR_709
 
-int generate_frame(const char* png_base64, AVFrame** frame_out) {
-  size_t b_length = 0;
-  const uint8_t* b_img =
-  base64_decode((const unsigned char*)png_base64,
-                strlen(png_base64),
-                &b_length);
-  MagickWand* wand = NewMagickWand();
-  MagickBooleanType res = MagickReadImageBlob(wand, b_img, b_length);
-  if (!res) {
-    printf("unable to read image blob\n");
-    return -1;
+/**
+ * Buffer pool for one picture size. Every frame buffer holds all three
+ * planes, laid out for MCU-aligned dimensions so the same pool serves
+ * every decoder backend.
+ */
+struct frame_pool_s {
+  int width;
+  int height;
+  int linesize[3];
+  size_t offset[3];
+  AVBufferPool* pool;
+  struct frame_pool_s* next;
+};
+
+/**
+ * Packed RGB layouts, as the decoders produce them. Four byte layouts carry
+ * alpha, which the conversion ignores.
+ */
+struct rgb_layout_s {
+  int bytes_per_pixel;
+  // picks the generator's conversion kernel
+  RGBLayout type;
+  // box filters and converts in one pass, for output_scale
+  rgb24_yuv420_scaled_fn convert_scaled;
+};
+
+static const struct rgb_layout_s rgb24_layout = {
+  3, RGB_LAYOUT_RGB24, rgb24_yuv420_scaled
+};
+static const struct rgb_layout_s rgba32_layout = {
+  4, RGB_LAYOUT_RGBA32, rgba32_yuv420_scaled
+};
+
+/**
+ * A decoded picture kept as the base for the ones after it: the RGB it was
+ * converted from, and a read-only reference to the resulting frame. Never
+ * modified once published.
+ */
+struct tile_reference_s {
+  int width;
+  int height;
+  const struct rgb_layout_s* layout;
+  size_t rgb_stride;
+  uint8_t* rgb;
+  size_t rgb_size;
+  AVFrame* frame;
+  int refs;
+  // spare list link
+  struct tile_reference_s* next;
+};
+
+struct frame_generator_s {
+  pthread_mutex_t pool_lock;
+  // most recently used first
+  struct frame_pool_s* pools;
+  int num_pools;
+  pthread_mutex_t reference_lock;
+  // most recently converted picture, if any
+  struct tile_reference_s* reference;
+  // released references, kept for their RGB buffers
+  struct tile_reference_s* spare_references;
+  // spreads full conversions of large pictures over all cores
+  struct slice_pool_s* slices;
+  // specialized for FRAME_YUV_TYPE, by RGBLayout. looked up once, at alloc.
+  rgb_yuv420_kernel_fn kernels[3];
+  struct frame_generator_config_s config;
+};
+
+// The part of an image that ends up in the frame.
+struct crop_rect_s {
+  int x;
+  int y;
+  int width;
+  int height;
+};
+
+struct image_source_s;
+
+/**
+ * Image decoder backends, tried in order. probe looks at the first bytes of
+ * an image and says whether decode should be attempted. If decode fails,
+ * the next backend that accepts the image gets a turn, reading the source
+ * again from the start.
+ */
+struct image_decoder_s {
+  const char* name;
+  char (*probe)(const uint8_t* data, size_t length);
+  int (*decode)(struct frame_generator_s* pthis,
+                struct image_source_s* source, AVFrame** frame_out);
+};
+
+#pragma mark - Frame pools
+
+static struct frame_pool_s* frame_pool_create(int width, int height) {
+  struct frame_pool_s* pool = calloc(1, sizeof(struct frame_pool_s));
+  pool->width = width;
+  pool->height = height;
+  int chroma_height = (height + 1) / 2;
+  pool->linesize[0] = FFALIGN(width, FRAME_LINESIZE_ALIGN);
+  pool->linesize[1] = FFALIGN((width + 1) / 2, FRAME_LINESIZE_ALIGN);
+  pool->linesize[2] = pool->linesize[1];
+  pool->offset[0] = 0;
+  pool->offset[1] = pool->offset[0] + (size_t)pool->linesize[0] * height;
+  pool->offset[2] = pool->offset[1] + (size_t)pool->linesize[1] * chroma_height;
+  size_t size = pool->offset[2] + (size_t)pool->linesize[2] * chroma_height +
+  FRAME_BUFFER_PADDING;
+  pool->pool = av_buffer_pool_init((int)size, av_buffer_alloc);
+  if (!pool->pool) {
+    free(pool);
+    return NULL;
   }
-  size_t width = MagickGetImageWidth(wand);
-  size_t height = MagickGetImageHeight(wand);
+  return pool;
+}
+
+static void frame_pool_free(struct frame_pool_s* pool) {
+  // frames still out in the world keep their buffers; the pool goes away
+  // once the last of them is unreferenced.
+  av_buffer_pool_uninit(&pool->pool);
+  free(pool);
+}
+
+// Called with pool_lock held.
+static struct frame_pool_s* get_frame_pool(struct frame_generator_s* pthis,
+                                           int width, int height)
+{
+  struct frame_pool_s* prev = NULL;
+  struct frame_pool_s* pool = pthis->pools;
+  while (pool && (pool->width != width || pool->height != height)) {
+    prev = pool;
+    pool = pool->next;
+  }
+  if (pool && prev) {
+    prev->next = pool->next;
+    pool->next = pthis->pools;
+    pthis->pools = pool;
+  } else if (!pool) {
+    pool = frame_pool_create(width, height);
+    if (!pool) {
+      return NULL;
+    }
+    pool->next = pthis->pools;
+    pthis->pools = pool;
+    pthis->num_pools++;
+    if (pthis->num_pools > FRAME_POOL_MAX) {
+      struct frame_pool_s* last = pthis->pools;
+      while (last->next->next) {
+        last = last->next;
+      }
+      frame_pool_free(last->next);
+      last->next = NULL;
+      pthis->num_pools--;
+    }
+  }
+  return pool;
+}
 
+/**
+ * Frame planes come from a pool for the picture size, rounded up to whole
+ * 16x16 MCUs. The frame itself reports the real size; rows and columns past
+ * it are there for decoders that write whole blocks.
+ */
+static AVFrame* alloc_yuv_frame(struct frame_generator_s* pthis,
+                                size_t width, size_t height)
+{
   AVFrame* frame = av_frame_alloc();
+  if (!frame) {
+    return NULL;
+  }
   frame->format = AV_PIX_FMT_YUV420P;
   frame->width = (int)width;
   frame->height = (int)height;
-  int ret = av_frame_get_buffer(frame, 1);
-  if (ret) {
+  pthread_mutex_lock(&pthis->pool_lock);
+  struct frame_pool_s* pool = get_frame_pool(pthis, FFALIGN((int)width, 16),
+                                             FFALIGN((int)height, 16));
+  if (pool) {
+    frame->buf[0] = av_buffer_pool_get(pool->pool);
+  }
+  for (int i = 0; frame->buf[0] && i < 3; i++) {
+    frame->data[i] = frame->buf[0]->data + pool->offset[i];
+    frame->linesize[i] = pool->linesize[i];
+  }
+  // another thread may retire the pool as soon as the lock is released
+  pthread_mutex_unlock(&pthis->pool_lock);
+  if (!frame->buf[0]) {
     printf("unable to allocate new avframe\n");
-    return ret;
+    av_frame_free(&frame);
+  }
+  return frame;
+}
+
+#pragma mark - Cropping
+
+// Clamps the configured crop to an image. An empty result keeps it all.
+// Coordinates are in image pixels, before output_scale.
+static void get_crop_rect(struct frame_generator_s* pthis,
+                          int width, int height, struct crop_rect_s* rect)
+{
+  struct frame_generator_config_s* config = &pthis->config;
+  rect->x = 0;
+  rect->y = 0;
+  rect->width = width;
+  rect->height = height;
+  if (config->crop_width <= 0 || config->crop_height <= 0) {
+    return;
+  }
+  // so the crop never splits a 4:2:0 chroma block, even once scaled
+  int align = 2 * config->output_scale;
+  int x = FFMAX(config->crop_x, 0) & ~(align - 1);
+  int y = FFMAX(config->crop_y, 0) & ~(align - 1);
+  int right = FFMIN((int64_t)config->crop_x + config->crop_width, width);
+  int bottom = FFMIN((int64_t)config->crop_y + config->crop_height, height);
+  // whole blocks only, or the last row and column would be left unconverted
+  int crop_width = (right - x) & ~(align - 1);
+  int crop_height = (bottom - y) & ~(align - 1);
+  if (crop_width <= 0 || crop_height <= 0) {
+    return;
+  }
+  rect->x = x;
+  rect->y = y;
+  rect->width = crop_width;
+  rect->height = crop_height;
+}
+
+// Narrows a full size frame down to rect, in place, by offsetting its plane
+// pointers. The buffer stays whole and is shared as before.
+static void crop_yuv_frame(AVFrame* frame, const struct crop_rect_s* rect) {
+  frame->data[0] += rect->y * frame->linesize[0] + rect->x;
+  for (int i = 1; i < 3; i++) {
+    frame->data[i] += (rect->y / 2) * frame->linesize[i] + rect->x / 2;
+  }
+  frame->width = rect->width;
+  frame->height = rect->height;
+}
+
+#pragma mark - Scratch space
+
+/**
+ * Decode intermediates live in per-thread arenas that only ever grow, so
+ * once a worker has seen the largest image in the stream it stops touching
+ * the heap. Freed when the thread exits.
+ */
+struct scratch_s {
+  uint8_t* data;
+  size_t size;
+};
+
+struct decode_scratch_s {
+  struct scratch_s base64;
+  struct scratch_s chunk;
+  struct scratch_s band_flags;
+  struct scratch_s tile_flags;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void decode_scratch_free(void* p) {
+  struct decode_scratch_s* scratch = (struct decode_scratch_s*)p;
+  free(scratch->base64.data);
+  free(scratch->chunk.data);
+  free(scratch->band_flags.data);
+  free(scratch->tile_flags.data);
+  free(scratch);
+}
+
+static void scratch_key_init() {
+  pthread_key_create(&scratch_key, decode_scratch_free);
+}
+
+static struct decode_scratch_s* get_decode_scratch() {
+  pthread_once(&scratch_once, scratch_key_init);
+  struct decode_scratch_s* scratch = pthread_getspecific(scratch_key);
+  if (!scratch) {
+    scratch = calloc(1, sizeof(struct decode_scratch_s));
+    pthread_setspecific(scratch_key, scratch);
+  }
+  return scratch;
+}
+
+static uint8_t* scratch_reserve(struct scratch_s* scratch, size_t size) {
+  if (scratch->size < size) {
+    uint8_t* data = realloc(scratch->data, size);
+    if (!data) {
+      return NULL;
+    }
+    scratch->data = data;
+    scratch->size = size;
+  }
+  return scratch->data;
+}
+
+#pragma mark - Image input
+
+// Decoded bytes handed to a decoder at a time. Small enough that base64
+// output is still in cache when the image decoder gets to it.
+#define IMAGE_CHUNK_SIZE (32 * 1024)
+// base64 text decoded for probing; more than any probe looks at
+#define IMAGE_PEEK_TEXT 64
+
+/**
+ * Encoded image bytes, read front to back a chunk at a time. Base64 is
+ * decoded as it is read, so the whole compressed image only exists in
+ * memory for decoders that ask for all of it at once.
+ */
+struct image_source_s {
+  const uint8_t* data;
+  size_t length;
+  char is_base64;
+  size_t offset;
+  struct base64_decoder_s base64;
+  // decoded bytes, for base64 input
+  uint8_t* chunk;
+  // every byte has been read, and the base64 checked
+  char is_read;
+  char is_bad;
+  // the decoder quit early on purpose, and has no use for the rest
+  char is_stopped;
+};
+
+static int image_source_init(struct image_source_s* source,
+                             const uint8_t* data, size_t length,
+                             char is_base64)
+{
+  memset(source, 0, sizeof(struct image_source_s));
+  source->data = data;
+  source->length = length;
+  source->is_base64 = is_base64;
+  base64_decoder_init(&source->base64);
+  if (is_base64) {
+    source->chunk = scratch_reserve(&get_decode_scratch()->chunk,
+                                    BASE64_DECODED_MAX(IMAGE_CHUNK_SIZE /
+                                                       3 * 4));
+    if (!source->chunk) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void image_source_rewind(struct image_source_s* source) {
+  source->offset = 0;
+  source->is_read = 0;
+  source->is_stopped = 0;
+  base64_decoder_init(&source->base64);
+}
+
+/**
+ * Copies out the first few decoded bytes without moving the read position.
+ * @param header at least BASE64_DECODED_MAX(IMAGE_PEEK_TEXT) bytes
+ */
+static size_t image_source_peek(struct image_source_s* source,
+                                uint8_t* header)
+{
+  if (!source->is_base64) {
+    size_t length = FFMIN(source->length, IMAGE_PEEK_TEXT / 4 * 3);
+    memcpy(header, source->data, length);
+    return length;
+  }
+  struct base64_decoder_s base64;
+  base64_decoder_init(&base64);
+  return base64_decoder_update(&base64, source->data,
+                               FFMIN(source->length, IMAGE_PEEK_TEXT), header);
+}
+
+/**
+ * Points chunk_out at the next bytes of the image, valid until the next
+ * read. Returns the number of bytes, or zero once the image is exhausted or
+ * its base64 turns out to be bad.
+ */
+static size_t image_source_read(struct image_source_s* source,
+                                const uint8_t** chunk_out)
+{
+  size_t length = 0;
+  if (source->is_read) {
+    return 0;
+  }
+  if (!source->is_base64) {
+    // nothing to decode; hand over everything that is left
+    length = source->length - source->offset;
+    *chunk_out = source->data + source->offset;
+    source->offset = source->length;
+    source->is_read = !length;
+    return length;
+  }
+  while (!length && source->offset < source->length) {
+    size_t text = FFMIN(IMAGE_CHUNK_SIZE / 3 * 4,
+                        source->length - source->offset);
+    length = base64_decoder_update(&source->base64,
+                                   source->data + source->offset, text,
+                                   source->chunk);
+    source->offset += text;
+  }
+  if (source->offset == source->length) {
+    source->is_read = 1;
+    if (base64_decoder_finish(&source->base64)) {
+      source->is_bad = 1;
+      length = 0;
+    }
+  }
+  *chunk_out = source->chunk;
+  return length;
+}
+
+/**
+ * For decoders that need the whole image in one piece. The buffer stays
+ * valid until this thread decodes another image.
+ */
+static int image_source_read_all(struct image_source_s* source,
+                                 const uint8_t** data_out,
+                                 size_t* length_out)
+{
+  source->is_read = 1;
+  if (!source->is_base64) {
+    *data_out = source->data;
+    *length_out = source->length;
+    return 0;
+  }
+  uint8_t* decoded = scratch_reserve(&get_decode_scratch()->base64,
+                                     BASE64_DECODED_MAX(source->length));
+  if (!decoded ||
+      base64_decode_to(source->data, source->length, decoded, length_out))
+  {
+    source->is_bad = 1;
+    return -1;
+  }
+  *data_out = decoded;
+  return 0;
+}
+
+/**
+ * For decoders that have all they need before the end of the image, such as
+ * a crop that ends above the bottom. The rest is then never decoded, not
+ * even to check its base64.
+ */
+static void image_source_stop(struct image_source_s* source) {
+  source->is_stopped = 1;
+}
+
+/**
+ * Reads whatever a decoder left unread, so bad base64 anywhere in the
+ * payload is caught, unless the decoder stopped early on purpose. Returns
+ * nonzero if the base64 was bad.
+ */
+static char image_source_finish(struct image_source_s* source) {
+  const uint8_t* chunk;
+  while (!source->is_stopped && image_source_read(source, &chunk));
+  return source->is_bad;
+}
+
+#pragma mark - Dirty tiles
+
+/**
+ * Screen content mostly changes in small places, a cursor or a clock. RGB
+ * pictures are compared tile by tile against the last one converted, and
+ * only tiles that differ go through color conversion; the rest of the frame
+ * is copied from the previous YUV frame. Decodes run concurrently, so the
+ * base is whichever picture was published last, not necessarily the one
+ * just before. The result is exact either way.
+ */
+struct tile_convert_s {
+  struct frame_generator_s* generator;
+  // previous picture of the same size, or NULL to convert everything
+  struct tile_reference_s* base;
+  // this picture. its RGB is written here by the decoder.
+  struct tile_reference_s* next;
+  AVFrame* frame;
+  // one per band of TILE_SIZE rows, set when nothing in it changed. those
+  // are copied from base at the end, if at all.
+  uint8_t* band_is_clean;
+  // one per tile in a band
+  uint8_t* tile_is_dirty;
+  int64_t tiles_dirty;
+  // large picture with no base: converted in one go, in parallel, once all
+  // of its RGB is in
+  char is_deferred;
+  // the frame is 1/scale the size of the RGB picture
+  int scale;
+  // the part of the picture that is converted: whole blocks of twice the
+  // scale, so the frame always has even dimensions
+  int width;
+  int height;
+};
+
+static void tile_reference_release(struct frame_generator_s* pthis,
+                                   struct tile_reference_s* reference)
+{
+  if (!reference) {
+    return;
+  }
+  pthread_mutex_lock(&pthis->reference_lock);
+  if (!--reference->refs) {
+    av_frame_free(&reference->frame);
+    reference->next = pthis->spare_references;
+    pthis->spare_references = reference;
+  }
+  pthread_mutex_unlock(&pthis->reference_lock);
+}
+
+static struct tile_reference_s* tile_reference_alloc
+(struct frame_generator_s* pthis, int width, int height,
+ const struct rgb_layout_s* layout)
+{
+  pthread_mutex_lock(&pthis->reference_lock);
+  struct tile_reference_s* reference = pthis->spare_references;
+  if (reference) {
+    pthis->spare_references = reference->next;
+  }
+  pthread_mutex_unlock(&pthis->reference_lock);
+  if (!reference) {
+    reference = calloc(1, sizeof(struct tile_reference_s));
+    if (!reference) {
+      return NULL;
+    }
+  }
+  reference->width = width;
+  reference->height = height;
+  reference->layout = layout;
+  reference->rgb_stride = (size_t)width * layout->bytes_per_pixel;
+  reference->refs = 1;
+  reference->next = NULL;
+  size_t rgb_size = reference->rgb_stride * height;
+  if (reference->rgb_size < rgb_size) {
+    uint8_t* rgb = realloc(reference->rgb, rgb_size);
+    if (!rgb) {
+      tile_reference_release(pthis, reference);
+      return NULL;
+    }
+    reference->rgb = rgb;
+    reference->rgb_size = rgb_size;
+  }
+  return reference;
+}
+
+static void tile_reference_free(struct tile_reference_s* reference) {
+  av_frame_free(&reference->frame);
+  free(reference->rgb);
+  free(reference);
+}
+
+static int tile_convert_begin(struct tile_convert_s* ctx,
+                              struct frame_generator_s* pthis,
+                              int width, int height,
+                              const struct rgb_layout_s* layout)
+{
+  memset(ctx, 0, sizeof(struct tile_convert_s));
+  ctx->generator = pthis;
+  ctx->scale = pthis->config.output_scale;
+  ctx->width = width & ~(2 * ctx->scale - 1);
+  ctx->height = height & ~(2 * ctx->scale - 1);
+  if (!ctx->width || !ctx->height) {
+    printf("image is smaller than the output scale\n");
+    return -1;
+  }
+  struct decode_scratch_s* scratch = get_decode_scratch();
+  ctx->band_is_clean = scratch_reserve(&scratch->band_flags,
+                                       height / TILE_SIZE + 1);
+  ctx->tile_is_dirty = scratch_reserve(&scratch->tile_flags,
+                                       width / TILE_SIZE + 1);
+  ctx->frame = alloc_yuv_frame(pthis, ctx->width / ctx->scale,
+                               ctx->height / ctx->scale);
+  ctx->next = tile_reference_alloc(pthis, width, height, layout);
+  if (!ctx->band_is_clean || !ctx->tile_is_dirty ||
+      !ctx->frame || !ctx->next)
+  {
+    av_frame_free(&ctx->frame);
+    tile_reference_release(pthis, ctx->next);
+    ctx->next = NULL;
+    return -1;
+  }
+  memset(ctx->band_is_clean, 0, height / TILE_SIZE + 1);
+  pthread_mutex_lock(&pthis->reference_lock);
+  struct tile_reference_s* base = pthis->reference;
+  if (base && base->width == width && base->height == height &&
+      base->layout == layout)
+  {
+    base->refs++;
+    ctx->base = base;
+  }
+  pthread_mutex_unlock(&pthis->reference_lock);
+  ctx->is_deferred = !ctx->base &&
+  (int64_t)width * height >= SLICE_POOL_MIN_PIXELS;
+  return 0;
+}
+
+static void tile_convert_abort(struct tile_convert_s* ctx) {
+  av_frame_free(&ctx->frame);
+  tile_reference_release(ctx->generator, ctx->base);
+  tile_reference_release(ctx->generator, ctx->next);
+  ctx->base = NULL;
+  ctx->next = NULL;
+}
+
+// Row pointer for the decoder to write RGB into.
+static uint8_t* tile_convert_row(struct tile_convert_s* ctx, int y) {
+  return ctx->next->rgb + y * ctx->next->rgb_stride;
+}
+
+static char rgb_tile_equal(const uint8_t* a, const uint8_t* b,
+                           size_t stride, int row_bytes, int rows)
+{
+#ifdef __SSE2__
+  if (!(row_bytes % 16)) {
+    __m128i diff = _mm_setzero_si128();
+    for (int y = 0; y < rows; y++, a += stride, b += stride) {
+      for (int i = 0; i < row_bytes; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+      }
+    }
+    return 0xFFFF == _mm_movemask_epi8(_mm_cmpeq_epi8(diff,
+                                                      _mm_setzero_si128()));
+  }
+#endif
+  for (int y = 0; y < rows; y++, a += stride, b += stride) {
+    if (memcmp(a, b, row_bytes)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Converts a rectangle of the new picture, given in RGB pixels. All four
+ * must be multiples of twice the scale.
+ */
+static void tile_convert_rect(struct tile_convert_s* ctx,
+                              int x, int y, int width, int rows)
+{
+  AVFrame* frame = ctx->frame;
+  const struct rgb_layout_s* layout = ctx->next->layout;
+  rgb_yuv420_kernel_fn convert = ctx->generator->kernels[layout->type];
+  size_t stride = ctx->next->rgb_stride;
+  const uint8_t* rgb = tile_convert_row(ctx, y) + x * layout->bytes_per_pixel;
+  int frame_x = x / ctx->scale;
+  int frame_y = y / ctx->scale;
+  uint8_t* y_plane = frame->data[0] + frame_y * frame->linesize[0] + frame_x;
+  uint8_t* u_plane = frame->data[1] + (frame_y / 2) * frame->linesize[1] +
+  frame_x / 2;
+  uint8_t* v_plane = frame->data[2] + (frame_y / 2) * frame->linesize[2] +
+  frame_x / 2;
+  if (ctx->scale > 1) {
+    slice_pool_rgb24_yuv420_scaled(ctx->generator->slices,
+                                   layout->convert_scaled, ctx->scale,
+                                   width, rows,
+                                   rgb, (uint32_t)stride,
+                                   y_plane, u_plane, v_plane,
+                                   frame->linesize[0], frame->linesize[1],
+                                   FRAME_YUV_TYPE);
+    return;
   }
+  slice_pool_rgb24_yuv420(ctx->generator->slices, convert,
+                          width, rows,
+                          rgb, (uint32_t)stride,
+                          y_plane, u_plane, v_plane,
+                          frame->linesize[0], frame->linesize[1]);
+}
 
-  uint8_t* rgb_buf_out = malloc(RGB_BYTES_PER_PIXEL * width * height);
+static void tile_copy_band(struct tile_convert_s* ctx, int band) {
+  AVFrame* dst = ctx->frame;
+  AVFrame* src = ctx->base->frame;
+  int band_rows = TILE_SIZE / ctx->scale;
+  int y = band * band_rows;
+  int rows = FFMIN(band_rows, dst->height - y);
+  av_image_copy_plane(dst->data[0] + y * dst->linesize[0], dst->linesize[0],
+                      src->data[0] + y * src->linesize[0], src->linesize[0],
+                      dst->width, rows);
+  for (int i = 1; i < 3; i++) {
+    av_image_copy_plane(dst->data[i] + (y / 2) * dst->linesize[i],
+                        dst->linesize[i],
+                        src->data[i] + (y / 2) * src->linesize[i],
+                        src->linesize[i],
+                        (dst->width + 1) / 2, (rows + 1) / 2);
+  }
+}
+
+/**
+ * Call once the RGB rows of a band are in place. Bands are TILE_SIZE rows,
+ * the last one possibly shorter. Rows past the converted part are ignored.
+ */
+static void tile_convert_band(struct tile_convert_s* ctx, int band) {
+  int width = ctx->width;
+  int y = band * TILE_SIZE;
+  int rows = FFMIN(TILE_SIZE, ctx->height - y);
+  if (rows <= 0) {
+    return;
+  }
+  int num_tiles = (width + TILE_SIZE - 1) / TILE_SIZE;
+  if (!ctx->base) {
+    if (!ctx->is_deferred) {
+      tile_convert_rect(ctx, 0, y, width, rows);
+    }
+    ctx->tiles_dirty += num_tiles;
+    return;
+  }
+  size_t stride = ctx->next->rgb_stride;
+  int bytes_per_pixel = ctx->next->layout->bytes_per_pixel;
+  const uint8_t* rgb = tile_convert_row(ctx, y);
+  const uint8_t* base_rgb = ctx->base->rgb + y * stride;
+  int band_dirty = 0;
+  for (int i = 0; i < num_tiles; i++) {
+    int x = i * TILE_SIZE;
+    int row_bytes = FFMIN(TILE_SIZE, width - x) * bytes_per_pixel;
+    size_t offset = x * bytes_per_pixel;
+    ctx->tile_is_dirty[i] = !rgb_tile_equal(rgb + offset, base_rgb + offset,
+                                            stride, row_bytes, rows);
+    band_dirty += ctx->tile_is_dirty[i];
+  }
+  if (!band_dirty) {
+    ctx->band_is_clean[band] = 1;
+    return;
+  }
+  ctx->tiles_dirty += band_dirty;
+  if (band_dirty < num_tiles) {
+    tile_copy_band(ctx, band);
+  }
+  // convert runs of dirty tiles, so wide changes still get wide SIMD rows
+  for (int i = 0; i < num_tiles;) {
+    if (!ctx->tile_is_dirty[i]) {
+      i++;
+      continue;
+    }
+    int first = i;
+    while (i < num_tiles && ctx->tile_is_dirty[i]) {
+      i++;
+    }
+    int x = first * TILE_SIZE;
+    tile_convert_rect(ctx, x, y, FFMIN(i * TILE_SIZE, width) - x, rows);
+  }
+}
+
+/**
+ * Finishes the frame and publishes this picture as the base for later
+ * ones. A picture with no changes at all comes out as a new reference to
+ * the base frame instead.
+ */
+static int tile_convert_finish(struct tile_convert_s* ctx,
+                               AVFrame** frame_out)
+{
+  struct frame_generator_s* pthis = ctx->generator;
+  if (ctx->is_deferred) {
+    tile_convert_rect(ctx, 0, 0, ctx->width, ctx->height);
+  }
+  if (ctx->base && !ctx->tiles_dirty) {
+    AVFrame* frame = av_frame_clone(ctx->base->frame);
+    if (frame) {
+      tile_convert_abort(ctx);
+      *frame_out = frame;
+      return 0;
+    }
+  }
+  int num_bands = (ctx->height + TILE_SIZE - 1) / TILE_SIZE;
+  for (int band = 0; ctx->base && band < num_bands; band++) {
+    if (ctx->band_is_clean[band]) {
+      tile_copy_band(ctx, band);
+    }
+  }
+  ctx->next->frame = av_frame_clone(ctx->frame);
+  if (ctx->next->frame) {
+    pthread_mutex_lock(&pthis->reference_lock);
+    struct tile_reference_s* old = pthis->reference;
+    pthis->reference = ctx->next;
+    ctx->next->refs++;
+    pthread_mutex_unlock(&pthis->reference_lock);
+    tile_reference_release(pthis, old);
+  }
+  *frame_out = ctx->frame;
+  ctx->frame = NULL;
+  tile_convert_abort(ctx);
+  return 0;
+}
+
+#pragma mark - libpng
+
+struct png_decode_s {
+  struct frame_generator_s* generator;
+  // RGB rows land in the picture, and are converted a band at a time
+  struct tile_convert_s tiles;
+  char has_tiles;
+  int height;
+  // rows and columns of the image that are kept
+  struct crop_rect_s crop;
+  int bytes_per_pixel;
+  char is_done;
+  // done at the bottom of the crop, before the end of the image
+  char is_cropped;
+};
+
+static char png_probe(const uint8_t* data, size_t length) {
+  return length >= 8 && !png_sig_cmp((png_const_bytep)data, 0, 8);
+}
+
+static void png_on_info(png_structp png, png_infop info) {
+  struct png_decode_s* ctx = (struct png_decode_s*)png_get_progressive_ptr(png);
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace_type;
+  png_get_IHDR(png, info, &width, &height, &bit_depth, &color_type,
+               &interlace_type, NULL, NULL);
+  if (PNG_INTERLACE_NONE != interlace_type) {
+    // Interlaced rows arrive over several passes; there is no row pair to
+    // convert until the last one. Let another backend deal with it.
+    png_error(png, "interlaced png");
+  }
+  // normalize everything to 8 bit RGB, keeping alpha if there is any. The
+  // converter skips over it, which is cheaper than libpng packing it out.
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  const struct rgb_layout_s* layout = &rgb24_layout;
+  if ((color_type & PNG_COLOR_MASK_ALPHA) ||
+      png_get_valid(png, info, PNG_INFO_tRNS))
+  {
+    layout = &rgba32_layout;
+  } else if (ctx->generator->config.output_scale > 1) {
+    // downscaling only has a SIMD path for 4 byte pixels
+    png_set_filler(png, 0, PNG_FILLER_AFTER);
+    layout = &rgba32_layout;
+  }
+  png_read_update_info(png, info);
+
+  get_crop_rect(ctx->generator, width, height, &ctx->crop);
+  if (tile_convert_begin(&ctx->tiles, ctx->generator,
+                         ctx->crop.width, ctx->crop.height, layout))
+  {
+    png_error(png, "frame allocation");
+  }
+  ctx->has_tiles = 1;
+  ctx->height = height;
+  ctx->bytes_per_pixel = layout->bytes_per_pixel;
+}
+
+static void png_on_row(png_structp png, png_bytep new_row,
+                       png_uint_32 row_num, int pass)
+{
+  struct png_decode_s* ctx = (struct png_decode_s*)png_get_progressive_ptr(png);
+  int y = (int)row_num - ctx->crop.y;
+  if (!new_row || y < 0 || y >= ctx->crop.height) {
+    return;
+  }
+  memcpy(tile_convert_row(&ctx->tiles, y),
+         new_row + ctx->crop.x * ctx->bytes_per_pixel,
+         ctx->tiles.next->rgb_stride);
+  if (TILE_SIZE - 1 == y % TILE_SIZE || ctx->crop.height - 1 == y) {
+    tile_convert_band(&ctx->tiles, y / TILE_SIZE);
+  }
+  if (ctx->crop.height - 1 == y &&
+      ctx->crop.y + ctx->crop.height < ctx->height)
+  {
+    // nothing below the crop is needed. stop inflating.
+    ctx->is_done = 1;
+    ctx->is_cropped = 1;
+  }
+}
+
+static void png_on_end(png_structp png, png_infop info) {
+  struct png_decode_s* ctx = (struct png_decode_s*)png_get_progressive_ptr(png);
+  ctx->is_done = 1;
+}
+
+static void png_on_warning(png_structp png, png_const_charp message) {
+  // libpng is chatty about harmless ancillary chunks. stay quiet.
+}
+
+static int png_decode(struct frame_generator_s* pthis,
+                      struct image_source_s* source, AVFrame** frame_out)
+{
+  struct png_decode_s ctx = { 0 };
+  ctx.generator = pthis;
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                           NULL, png_on_warning);
+  if (!png) {
+    return -1;
+  }
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return -1;
+  }
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    if (ctx.has_tiles) {
+      tile_convert_abort(&ctx.tiles);
+    }
+    return -1;
+  }
+  png_set_progressive_read_fn(png, &ctx, png_on_info, png_on_row, png_on_end);
+  // Rows are converted from inside png_process_data, as libpng inflates
+  // them. libpng keeps whatever it needs across chunk boundaries. Raw input
+  // comes in one piece; feed it in bounded steps too, so a crop that ends
+  // early stops inflating soon after.
+  const uint8_t* chunk;
+  size_t chunk_length;
+  while (!ctx.is_done && (chunk_length = image_source_read(source, &chunk))) {
+    for (size_t i = 0; !ctx.is_done && i < chunk_length;
+         i += IMAGE_CHUNK_SIZE)
+    {
+      png_process_data(png, info, (png_bytep)chunk + i,
+                       FFMIN(IMAGE_CHUNK_SIZE, chunk_length - i));
+    }
+  }
+  png_destroy_read_struct(&png, &info, NULL);
+  if (!ctx.is_done) {
+    printf("truncated png\n");
+    if (ctx.has_tiles) {
+      tile_convert_abort(&ctx.tiles);
+    }
+    return -1;
+  }
+  if (ctx.is_cropped) {
+    image_source_stop(source);
+  }
+  return tile_convert_finish(&ctx.tiles, frame_out);
+}
+
+#pragma mark - libjpeg
+
+// JPEG 4:2:0 is already the layout we want, but not the color space: JFIF
+// samples are full range BT.601, and everything else we produce is video
+// range BT.709. Going through RGB, with chroma centered on zero:
+//   Y'  = Y - 0.118188 Cb - 0.212685 Cr
+//   Cb' =     1.018640 Cb + 0.114618 Cr
+//   Cr' =     0.075049 Cb + 1.025327 Cr
+// Below with the range compression (219/255 luma, 224/255 chroma) folded
+// in, as 16.16 fixed point.
+#define JPEG_Y_Y 56284
+#define JPEG_Y_CB -6652
+#define JPEG_Y_CR -11971
+#define JPEG_CB_CB 58642
+#define JPEG_CB_CR 6598
+#define JPEG_CR_CB 4321
+#define JPEG_CR_CR 59027
+#define JPEG_FIX_HALF (1 << 15)
+
+// Converts a rectangle of the frame in place. Luma goes first, since it
+// needs the chroma as decoded.
+static void jpeg_convert_to_709(AVFrame* frame, int x, int y,
+                                int width, int height)
+{
+  for (int row = y; row < y + height; row++) {
+    uint8_t* luma = frame->data[0] + row * frame->linesize[0];
+    const uint8_t* cb = frame->data[1] + (row / 2) * frame->linesize[1];
+    const uint8_t* cr = frame->data[2] + (row / 2) * frame->linesize[2];
+    for (int col = x; col < x + width; col++) {
+      int32_t u = cb[col / 2] - 128;
+      int32_t v = cr[col / 2] - 128;
+      luma[col] = av_clip_uint8((JPEG_Y_Y * luma[col] + JPEG_Y_CB * u +
+                                 JPEG_Y_CR * v + (16 << 16) +
+                                 JPEG_FIX_HALF) >> 16);
+    }
+  }
+  int chroma_x = x / 2;
+  int chroma_y = y / 2;
+  int chroma_width = (x + width + 1) / 2 - chroma_x;
+  int chroma_height = (y + height + 1) / 2 - chroma_y;
+  for (int row = chroma_y; row < chroma_y + chroma_height; row++) {
+    uint8_t* cb = frame->data[1] + row * frame->linesize[1];
+    uint8_t* cr = frame->data[2] + row * frame->linesize[2];
+    for (int col = chroma_x; col < chroma_x + chroma_width; col++) {
+      int32_t u = cb[col] - 128;
+      int32_t v = cr[col] - 128;
+      cb[col] = av_clip_uint8((JPEG_CB_CB * u + JPEG_CB_CR * v +
+                               (128 << 16) + JPEG_FIX_HALF) >> 16);
+      cr[col] = av_clip_uint8((JPEG_CR_CB * u + JPEG_CR_CR * v +
+                               (128 << 16) + JPEG_FIX_HALF) >> 16);
+    }
+  }
+}
+
+struct jpeg_decode_s {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+  AVFrame* frame;
+};
+
+static void jpeg_on_error(j_common_ptr cinfo) {
+  struct jpeg_decode_s* ctx = (struct jpeg_decode_s*)cinfo->err;
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  printf("libjpeg: %s\n", message);
+  longjmp(ctx->jmp, 1);
+}
+
+static void jpeg_on_message(j_common_ptr cinfo, int msg_level) {
+  // warnings about corrupt data still produce a usable image. stay quiet.
+}
+
+static char jpeg_probe(const uint8_t* data, size_t length) {
+  return length >= 3 && 0xFF == data[0] && 0xD8 == data[1] && 0xFF == data[2];
+}
+
+static char jpeg_is_yuv420(struct jpeg_decompress_struct* cinfo) {
+  jpeg_component_info* comp = cinfo->comp_info;
+  return JCS_YCbCr == cinfo->jpeg_color_space &&
+  3 == cinfo->num_components &&
+  2 == comp[0].h_samp_factor && 2 == comp[0].v_samp_factor &&
+  1 == comp[1].h_samp_factor && 1 == comp[1].v_samp_factor &&
+  1 == comp[2].h_samp_factor && 1 == comp[2].v_samp_factor;
+}
+
+// libjpeg source manager reading from an image_source_s
+struct jpeg_source_s {
+  struct jpeg_source_mgr pub;
+  struct image_source_s* source;
+};
+
+static void jpeg_source_init(j_decompress_ptr cinfo) {
+}
+
+static boolean jpeg_source_fill(j_decompress_ptr cinfo) {
+  static const JOCTET fake_eoi[2] = { 0xFF, JPEG_EOI };
+  struct jpeg_source_s* src = (struct jpeg_source_s*)cinfo->src;
+  const uint8_t* chunk;
+  size_t length = image_source_read(src->source, &chunk);
+  if (!length) {
+    // out of data. end the image here, like jpeg_mem_src does.
+    chunk = fake_eoi;
+    length = sizeof(fake_eoi);
+  }
+  src->pub.next_input_byte = chunk;
+  src->pub.bytes_in_buffer = length;
+  return TRUE;
+}
+
+static void jpeg_source_skip(j_decompress_ptr cinfo, long num_bytes) {
+  struct jpeg_source_mgr* src = cinfo->src;
+  if (num_bytes <= 0) {
+    return;
+  }
+  while (num_bytes > (long)src->bytes_in_buffer) {
+    num_bytes -= (long)src->bytes_in_buffer;
+    src->fill_input_buffer(cinfo);
+  }
+  src->next_input_byte += num_bytes;
+  src->bytes_in_buffer -= num_bytes;
+}
+
+static void jpeg_source_term(j_decompress_ptr cinfo) {
+}
+
+static int jpeg_decode(struct frame_generator_s* pthis,
+                       struct image_source_s* source, AVFrame** frame_out)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_decode_s ctx = { 0 };
+  struct jpeg_source_s src = { { 0 } };
+  src.pub.init_source = jpeg_source_init;
+  src.pub.fill_input_buffer = jpeg_source_fill;
+  src.pub.skip_input_data = jpeg_source_skip;
+  src.pub.resync_to_restart = jpeg_resync_to_restart;
+  src.pub.term_source = jpeg_source_term;
+  src.source = source;
+  cinfo.err = jpeg_std_error(&ctx.pub);
+  ctx.pub.error_exit = jpeg_on_error;
+  ctx.pub.emit_message = jpeg_on_message;
+  if (setjmp(ctx.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    av_frame_free(&ctx.frame);
+    return -1;
+  }
+  jpeg_create_decompress(&cinfo);
+  cinfo.src = &src.pub;
+  jpeg_read_header(&cinfo, TRUE);
+  if (!jpeg_is_yuv420(&cinfo)) {
+    // other subsamplings would need resampling anyway
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  // crop in image pixels, then brought down to output pixels
+  int scale = pthis->config.output_scale;
+  struct crop_rect_s crop;
+  get_crop_rect(pthis, cinfo.image_width, cinfo.image_height, &crop);
+  crop.x /= scale;
+  crop.y /= scale;
+  // whole chroma blocks, as tile_convert_begin does for the other decoders
+  crop.width = (crop.width / scale) & ~1;
+  crop.height = (crop.height / scale) & ~1;
+  if (!crop.width || !crop.height) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  cinfo.raw_data_out = TRUE;
+  cinfo.do_fancy_upsampling = FALSE;
+  // output_scale comes for free from the IDCT, which then does less work
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = scale;
+  jpeg_start_decompress(&cinfo);
+
+  // libjpeg writes whole MCUs, edges included: 16x16 luma when not scaled.
+  // Pooled planes are already sized for that, past the real picture.
+  int width = cinfo.output_width;
+  int height = cinfo.output_height;
+#if JPEG_LIB_VERSION >= 70
+  int mcu_rows = cinfo.max_v_samp_factor * cinfo.min_DCT_v_scaled_size;
+#else
+  int mcu_rows = cinfo.max_v_samp_factor * cinfo.min_DCT_scaled_size;
+#endif
+  ctx.frame = alloc_yuv_frame(pthis, width, height);
+  if (!ctx.frame) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  AVFrame* frame = ctx.frame;
+
+  // decode straight into the frame planes, one MCU row at a time.
+  JSAMPROW y_rows[16];
+  JSAMPROW u_rows[8];
+  JSAMPROW v_rows[8];
+  JSAMPARRAY planes[3] = { y_rows, u_rows, v_rows };
+  // MCU rows past the bottom of the crop are never decoded
+  int crop_bottom = crop.y + crop.height;
+  while (cinfo.output_scanline < (JDIMENSION)crop_bottom) {
+    int luma_row = cinfo.output_scanline;
+    int chroma_row = luma_row / 2;
+    for (int i = 0; i < mcu_rows; i++) {
+      y_rows[i] = frame->data[0] + (luma_row + i) * frame->linesize[0];
+    }
+    for (int i = 0; i < mcu_rows / 2; i++) {
+      u_rows[i] = frame->data[1] + (chroma_row + i) * frame->linesize[1];
+      v_rows[i] = frame->data[2] + (chroma_row + i) * frame->linesize[2];
+    }
+    if (!jpeg_read_raw_data(&cinfo, planes, mcu_rows)) {
+      break;
+    }
+    // convert while the rows are still in cache, for the part of them
+    // inside the crop
+    int top = FFMAX(luma_row, crop.y);
+    int luma_rows = FFMIN(luma_row + mcu_rows, crop_bottom) - top;
+    if (luma_rows > 0) {
+      jpeg_convert_to_709(frame, crop.x, top, crop.width, luma_rows);
+    }
+  }
+  if (cinfo.output_scanline < cinfo.output_height) {
+    // stopped at the crop. finishing would decode the rest.
+    jpeg_abort_decompress(&cinfo);
+    image_source_stop(source);
+  } else {
+    jpeg_finish_decompress(&cinfo);
+  }
+  jpeg_destroy_decompress(&cinfo);
+  crop_yuv_frame(frame, &crop);
+  *frame_out = frame;
+  return 0;
+}
+
+#pragma mark - MagickWand
+
+static char magick_probe(const uint8_t* data, size_t length) {
+  // anything ImageMagick understands
+  return 1;
+}
+
+static int magick_decode(struct frame_generator_s* pthis,
+                         struct image_source_s* source, AVFrame** frame_out)
+{
+  const uint8_t* data;
+  size_t length;
+  if (image_source_read_all(source, &data, &length)) {
+    return -1;
+  }
+  MagickWand* wand = NewMagickWand();
+  MagickBooleanType res = MagickReadImageBlob(wand, data, length);
+  if (!res) {
+    printf("unable to read image blob\n");
+    DestroyMagickWand(wand);
+    return -1;
+  }
+  size_t width = MagickGetImageWidth(wand);
+  size_t height = MagickGetImageHeight(wand);
+
+  // ImageMagick keeps pixels as RGBA quanta. Exporting all four channels
+  // hits its fast path and gives the converter aligned 4 byte pixels.
+  struct crop_rect_s crop;
+  get_crop_rect(pthis, (int)width, (int)height, &crop);
+  struct tile_convert_s tiles;
+  if (tile_convert_begin(&tiles, pthis, crop.width, crop.height,
+                         &rgba32_layout))
+  {
+    DestroyMagickWand(wand);
+    return -1;
+  }
 
   // push modified wand back to rgb buffer
-  res = MagickExportImagePixels(wand, 0, 0,
-                                width,
-                                height,
-                                "RGB", CharPixel,
-                                rgb_buf_out);
+  res = MagickExportImagePixels(wand, crop.x, crop.y,
+                                crop.width,
+                                crop.height,
+                                "RGBA", CharPixel,
+                                tile_convert_row(&tiles, 0));
+  DestroyMagickWand(wand);
   if (!res) {
     printf("unable to export converted image pixels");
+    tile_convert_abort(&tiles);
     return -1;
   }
 
   // send contrast_wand off to the frame buffer
-  rgb24_yuv420_std(frame->width, frame->height,
-                   rgb_buf_out, frame->width * RGB_BYTES_PER_PIXEL,
-                   frame->data[0],
-                   frame->data[1],
-                   frame->data[2],
-                   frame->linesize[0],
-                   frame->linesize[1], YCBCR_709);
-  free(rgb_buf_out);
+  int num_bands = (crop.height + TILE_SIZE - 1) / TILE_SIZE;
+  for (int band = 0; band < num_bands; band++) {
+    tile_convert_band(&tiles, band);
+  }
+  return tile_convert_finish(&tiles, frame_out);
+}
 
-  *frame_out = frame;
+#pragma mark - Public API
 
-  DestroyMagickWand(wand);
-  free((void*)b_img);
+static const struct image_decoder_s image_decoders[] = {
+  { "libpng", png_probe, png_decode },
+  { "libjpeg", jpeg_probe, jpeg_decode },
+  { "MagickWand", magick_probe, magick_decode },
+};
+
+int frame_generator_alloc(struct frame_generator_s** generator) {
+  struct frame_generator_s* pthis = (struct frame_generator_s*)
+  calloc(1, sizeof(struct frame_generator_s));
+  if (!pthis) {
+    return -1;
+  }
+  pthread_mutex_init(&pthis->pool_lock, NULL);
+  pthread_mutex_init(&pthis->reference_lock, NULL);
+  pthis->config.output_scale = 1;
+  pthis->kernels[RGB_LAYOUT_RGB24] =
+  rgb_yuv420_kernel(FRAME_YUV_TYPE, RGB_LAYOUT_RGB24);
+  pthis->kernels[RGB_LAYOUT_RGBA32] =
+  rgb_yuv420_kernel(FRAME_YUV_TYPE, RGB_LAYOUT_RGBA32);
+  pthis->kernels[RGB_LAYOUT_BGRA32] =
+  rgb_yuv420_kernel(FRAME_YUV_TYPE, RGB_LAYOUT_BGRA32);
+  slice_pool_alloc(&pthis->slices, 0);
+  *generator = pthis;
   return 0;
 }
+
+void frame_generator_load_config(struct frame_generator_s* pthis,
+                                 struct frame_generator_config_s* config)
+{
+  pthis->config = *config;
+  int scale = pthis->config.output_scale;
+  if (scale != 2 && scale != 4) {
+    if (scale > 1) {
+      printf("unsupported output scale %d. keeping full size\n", scale);
+    }
+    pthis->config.output_scale = 1;
+  }
+}
+
+void frame_generator_free(struct frame_generator_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  while (pthis->pools) {
+    struct frame_pool_s* pool = pthis->pools;
+    pthis->pools = pool->next;
+    frame_pool_free(pool);
+  }
+  if (pthis->reference) {
+    tile_reference_free(pthis->reference);
+  }
+  while (pthis->spare_references) {
+    struct tile_reference_s* reference = pthis->spare_references;
+    pthis->spare_references = reference->next;
+    tile_reference_free(reference);
+  }
+  slice_pool_free(pthis->slices);
+  pthread_mutex_destroy(&pthis->pool_lock);
+  pthread_mutex_destroy(&pthis->reference_lock);
+  free(pthis);
+}
+
+int generate_frame(struct frame_generator_s* pthis,
+                   const uint8_t* data, size_t length, char is_base64,
+                   AVFrame** frame_out)
+{
+  struct image_source_s source;
+  if (image_source_init(&source, data, length, is_base64)) {
+    return -1;
+  }
+  uint8_t header[BASE64_DECODED_MAX(IMAGE_PEEK_TEXT)];
+  size_t header_length = image_source_peek(&source, header);
+  int ret = -1;
+  size_t num_decoders = sizeof(image_decoders) / sizeof(image_decoders[0]);
+  for (size_t i = 0; i < num_decoders && ret && !source.is_bad; i++) {
+    const struct image_decoder_s* decoder = &image_decoders[i];
+    if (!decoder->probe(header, header_length)) {
+      continue;
+    }
+    image_source_rewind(&source);
+    ret = decoder->decode(pthis, &source, frame_out);
+    if (ret) {
+      printf("%s could not decode image\n", decoder->name);
+    }
+  }
+  if (!ret && image_source_finish(&source)) {
+    av_frame_free(frame_out);
+    ret = -1;
+  }
+  if (source.is_bad) {
+    printf("unable to decode base64 image\n");
+  }
+  return ret;
+}
@@ -10,6 +10,42 @@
 
 #include <libavutil/frame.h>
 
-int generate_frame(const char* png_base64, AVFrame** frame_out);
+/**
+ * Decodes screencast images into YUV420P frames. Frame buffers are recycled
+ * through per-resolution pools owned by the generator. Frames may outlive
+ * the generator.
+ */
+struct frame_generator_s;
+
+struct frame_generator_config_s {
+  // Region of each image to keep, in image pixels. Frames come out at the
+  // size of the region, and pixels outside it are never converted. All four
+  // round down to a multiple of twice output_scale. Zero width or height
+  // keeps the whole image.
+  int crop_x;
+  int crop_y;
+  int crop_width;
+  int crop_height;
+  // 1, 2 or 4. Frames come out at 1/output_scale the width and height of
+  // the (cropped) image, each output pixel the average of the block it
+  // covers. Frames always have even dimensions: pixels past the last whole
+  // block of twice output_scale are dropped. Zero means 1.
+  int output_scale;
+};
+
+int frame_generator_alloc(struct frame_generator_s** generator);
+/** Call before the first generate_frame. */
+void frame_generator_load_config(struct frame_generator_s* generator,
+                                 struct frame_generator_config_s* config);
+void frame_generator_free(struct frame_generator_s* generator);
+
+/**
+ * Decode an encoded image into a new YUV420P frame. Safe to call from many
+ * threads at once.
+ * @param data encoded image bytes, or base64 text of the same if is_base64
+ */
+int generate_frame(struct frame_generator_s* generator,
+                   const uint8_t* data, size_t length, char is_base64,
+                   AVFrame** frame_out);
 
 #endif /* frame_generator_h */
@@ -11,65 +11,88 @@
 #include <uv.h>
 #include <assert.h>
 #include "horseman.h"
-#include "frame_generator.h"
-#include "audio_mixer.h"
-#include "growing_file_audio_source.h"
-#include "audio_frame_converter.h"
-#include "video_frame_buffer.h"
+
+// about a second of screencast at typical frame rates
+#define HORSEMAN_DEFAULT_MAX_QUEUED_FRAMES 30
 
 struct horseman_s {
   void* zmq_ctx;
   void* screencast_socket;
   void* blobsink_socket;
-  char is_interrupted;
-  uv_thread_t zmq_thread;
-  
-  // Atomic integer counts active jobs queued to uv loop
-  uv_mutex_t work_lock;
+  uv_poll_t screencast_poll;
+  uv_poll_t blobsink_poll;
+
+  // Atomic counters. work_count covers every message received but not yet
+  // released through on_video_ready, wherever it currently sits.
   int64_t work_count;
+  int64_t received_count;
+  int64_t dropped_count;
+  int64_t duplicate_count;
+  int64_t reused_count;
+  int64_t coalesced_count;
 
   void (*on_video_msg)(struct horseman_s* queue,
                        struct horseman_msg_s* msg, void* p);
+  void (*on_video_ready)(struct horseman_s* queue,
+                         struct horseman_msg_s* msg, void* p);
+  void (*on_blob_msg)(struct horseman_s* queue,
+                      struct horseman_msg_s* msg, void* p);
+  char (*should_decode)(struct horseman_s* queue,
+                        struct horseman_msg_s* msg, void* p);
   void* callback_p;
 
+  uv_async_t stop_async;
+  uint64_t next_sequence;
+
+  // Admission control, loop thread only: messages waiting for a decode slot
+  // and the number currently on the worker pool.
+  struct horseman_msg_s* pending_head;
+  struct horseman_msg_s* pending_tail;
+  int pending_count;
+  int in_flight_count;
+  int max_in_flight;
+  int max_queued_frames;
+
+  // Decoded messages that finished ahead of an earlier sequence number,
+  // sorted by sequence. Only touched on the loop thread.
+  struct horseman_msg_s* reorder_head;
+  uint64_t next_sequence_out;
+
+  // Identical payload detection, loop thread only. Hash of the last payload
+  // sent to decode, and the last frame handed to on_video_ready with its
+  // hash and a reference to the payload it was decoded from.
+  uint64_t last_decoded_hash;
+  char has_last_decoded;
+  AVFrame* last_ready_frame;
+  uint64_t last_ready_hash;
+  zmq_msg_t last_ready_payload;
+  char has_last_ready_payload;
+
   // Separate runloop for dispatching callbacks.
   uv_loop_t* loop;
   uv_thread_t loop_thread;
   char is_running;
 };
 
-static void horseman_loop_main(void* p) {
-  struct horseman_s* pthis = (struct horseman_s*)p;
-  int ret = 0;
-  while (pthis->is_running && 0 == ret) {
-    ret = uv_run(pthis->loop, UV_RUN_DEFAULT);
-  }
-  printf("horseman: exiting worker loop\n");
-}
 
-void decrement_work_count(struct horseman_s* pthis) {
-  uv_mutex_lock(&pthis->work_lock);
-  pthis->work_count = 0;
-  uv_mutex_unlock(&pthis->work_lock);
+static inline int64_t decrement_work_count(struct horseman_s* pthis) {
+  return __atomic_sub_fetch(&pthis->work_count, 1, __ATOMIC_SEQ_CST);
 }
 
-void increment_work_count(struct horseman_s* pthis) {
-  uv_mutex_lock(&pthis->work_lock);
-  pthis->work_count++;
-  uv_mutex_unlock(&pthis->work_lock);
+static inline int64_t increment_work_count(struct horseman_s* pthis) {
+  return __atomic_add_fetch(&pthis->work_count, 1, __ATOMIC_SEQ_CST);
 }
 
-int64_t get_work_count(struct horseman_s* pthis) {
-  int64_t ret = 0;
-  uv_mutex_lock(&pthis->work_lock);
-  ret = pthis->work_count;
-  uv_mutex_unlock(&pthis->work_lock);
-  return ret;
+static inline int64_t get_work_count(struct horseman_s* pthis) {
+  return __atomic_load_n(&pthis->work_count, __ATOMIC_SEQ_CST);
 }
 
 static void horseman_msg_free(struct horseman_msg_s* msg) {
-  if (msg->sz_data) {
-    free(msg->sz_data);
+  if (msg->has_data) {
+    zmq_msg_close(&msg->data_msg);
+  }
+  if (msg->frame) {
+    av_frame_free(&msg->frame);
   }
   if (msg->sz_sid) {
     free(msg->sz_sid);
@@ -77,46 +100,175 @@ static void horseman_msg_free(struct horseman_msg_s* msg) {
   free(msg);
 }
 
+// Timestamp arrives as text without a terminator. Copy it out before parsing.
+static double parse_timestamp(zmq_msg_t* message) {
+  char sz_ts[32];
+  size_t length = zmq_msg_size(message);
+  if (length >= sizeof(sz_ts)) {
+    length = sizeof(sz_ts) - 1;
+  }
+  memcpy(sz_ts, zmq_msg_data(message), length);
+  sz_ts[length] = '\0';
+  return atof(sz_ts);
+}
+
+static char* copy_string(zmq_msg_t* message) {
+  size_t length = zmq_msg_size(message);
+  char* sz_out = (char*)malloc(length + 1);
+  memcpy(sz_out, zmq_msg_data(message), length);
+  sz_out[length] = '\0';
+  return sz_out;
+}
+
+static inline uint32_t read_le32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+  ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline int64_t read_le64(const uint8_t* p) {
+  return (int64_t)((uint64_t)read_le32(p) | ((uint64_t)read_le32(p + 4) << 32));
+}
+
+// Not cryptographic: only has to tell apart consecutive screencast frames,
+// and do it much faster than decoding them. Eight bytes per step.
+static uint64_t payload_hash(const uint8_t* data, size_t length) {
+  const uint64_t prime = 0x9E3779B97F4A7C15ULL;
+  uint64_t hash = length * prime;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    hash ^= word * prime;
+    hash = ((hash << 31) | (hash >> 33)) * 0xC2B2AE3D27D4EB4FULL;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, length - i);
+  hash ^= tail * prime;
+  // murmur3 finalizer
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+enum binary_header_e {
+  // legacy payload
+  HEADER_NONE = 0,
+  HEADER_BINARY,
+  // a binary header we cannot read. the message is dropped.
+  HEADER_UNSUPPORTED
+};
+
+// Classifies the first part of a screencast message, filling in the header
+// fields of msg if it is a binary protocol header.
+static enum binary_header_e parse_binary_header(zmq_msg_t* message,
+                                                struct horseman_msg_s* msg)
+{
+  const uint8_t* header = (const uint8_t*)zmq_msg_data(message);
+  if (HORSEMAN_HEADER_SIZE != zmq_msg_size(message) ||
+      memcmp(header, "ICHB", 4))
+  {
+    return HEADER_NONE;
+  }
+  if (HORSEMAN_PROTOCOL_VERSION != header[4]) {
+    printf("horseman: unsupported protocol version %d\n", header[4]);
+    return HEADER_UNSUPPORTED;
+  }
+  msg->timestamp = (double)read_le64(header + 8) / 1000;
+  return HEADER_BINARY;
+}
+
+enum message_part_e {
+  PART_HEADER,
+  PART_DATA,
+  PART_TIMESTAMP,
+  PART_SID,
+  PART_EXTRA,
+  // read and thrown away without a word
+  PART_DISCARD
+};
+
+// Part tables end with PART_EXTRA, which absorbs anything past the end.
+static const enum message_part_e legacy_parts[] = {
+  PART_DATA, PART_TIMESTAMP, PART_SID, PART_EXTRA
+};
+
+static const enum message_part_e binary_parts[] = {
+  PART_HEADER, PART_DATA, PART_SID, PART_EXTRA
+};
+
+static const enum message_part_e blob_parts[] = {
+  PART_DATA, PART_SID, PART_EXTRA
+};
+
+// the rest of a message that is being dropped
+static const enum message_part_e discard_parts[] = {
+  PART_DISCARD
+};
+
 static int receive_message(void* socket, struct horseman_msg_s* msg,
+                           const enum message_part_e* parts,
                            char* got_message)
 {
   int ret;
-  if (msg->sz_data) {
-    free(msg->sz_data);
-  }
-  if (msg->sz_sid) {
-    free(msg->sz_sid);
-  }
-  memset(msg, 0, sizeof(struct horseman_msg_s));
+  int part_index = 0;
   while (1) {
     zmq_msg_t message;
     ret = zmq_msg_init (&message);
-    ret = zmq_msg_recv (&message, socket, 0);
-    if (ret < 0 && EAGAIN == errno) {
-      *got_message = 0;
+    ret = zmq_msg_recv (&message, socket, ZMQ_DONTWAIT);
+    if (ret < 0) {
+      int err = errno;
       zmq_msg_close(&message);
-      return 0;
+      if (EAGAIN == err && 0 == part_index) {
+        *got_message = 0;
+        return 0;
+      }
+      return err;
     }
     *got_message = 1;
+    int more = zmq_msg_more(&message);
+
+    // Screencasts decide their wire format from the first part.
+    enum binary_header_e header = HEADER_NONE;
+    if (0 == part_index && legacy_parts == parts) {
+      header = parse_binary_header(&message, msg);
+    }
+    if (HEADER_BINARY == header) {
+      parts = binary_parts;
+      msg->payload_type = HORSEMAN_PAYLOAD_RAW;
+    } else if (HEADER_UNSUPPORTED == header) {
+      // no payload is kept, so the caller drops the message
+      parts = discard_parts;
+    } else if (0 == part_index) {
+      msg->payload_type = legacy_parts == parts ?
+      HORSEMAN_PAYLOAD_BASE64 : HORSEMAN_PAYLOAD_RAW;
+    }
+    enum message_part_e part = parts[part_index];
+    if (PART_EXTRA != part && PART_DISCARD != part) {
+      part_index++;
+    }
+
     // Process the message frame
-    uint8_t* sz_msg = (uint8_t*)malloc(zmq_msg_size(&message) + 1);
-    memcpy(sz_msg, zmq_msg_data(&message), zmq_msg_size(&message));
-    sz_msg[zmq_msg_size(&message)] = '\0';
-
-    if (!msg->sz_data) {
-      msg->sz_data = (char*)sz_msg;
-    } else if (!msg->timestamp) {
-      msg->timestamp = atof((char*)sz_msg);
-      free(sz_msg);
-    } else if (!msg->sz_sid) {
-      msg->sz_sid = (char*)sz_msg;
-    } else {
+    if (PART_DATA == part) {
+      // Take ownership of the payload instead of copying it out: screencast
+      // frames run several megabytes each.
+      zmq_msg_init(&msg->data_msg);
+      zmq_msg_move(&msg->data_msg, &message);
+      msg->data = (const uint8_t*)zmq_msg_data(&msg->data_msg);
+      msg->data_length = zmq_msg_size(&msg->data_msg);
+      msg->has_data = 1;
+    } else if (PART_TIMESTAMP == part) {
+      msg->timestamp = parse_timestamp(&message);
+    } else if (PART_SID == part) {
+      msg->sz_sid = copy_string(&message);
+    } else if (PART_EXTRA == part) {
       printf("unknown extra message part received. freeing.");
-      free(sz_msg);
     }
 
     zmq_msg_close (&message);
-    if (!zmq_msg_more (&message))
+    if (!more)
       break;      //  Last message frame
   }
   return 0;
@@ -135,66 +287,348 @@ static void dispatch_video_msg(uv_work_t* work) {
   pthis->on_video_msg(pthis, msg, pthis->callback_p);
 }
 
+// Hold a finished message until everything before it has been released.
+static void reorder_insert(struct horseman_s* pthis,
+                           struct horseman_msg_s* msg)
+{
+  struct horseman_msg_s** it = &pthis->reorder_head;
+  while (*it && (*it)->sequence < msg->sequence) {
+    it = &(*it)->next;
+  }
+  msg->next = *it;
+  *it = msg;
+}
+
+// Remember what was just handed out, so an identical payload right behind it
+// can be served without decoding.
+static void remember_ready_frame(struct horseman_s* pthis,
+                                 struct horseman_msg_s* msg)
+{
+  av_frame_free(&pthis->last_ready_frame);
+  if (pthis->has_last_ready_payload) {
+    zmq_msg_close(&pthis->last_ready_payload);
+    pthis->has_last_ready_payload = 0;
+  }
+  // a payload that failed to decode is kept too: it would fail again
+  if (msg->has_data) {
+    if (msg->frame) {
+      pthis->last_ready_frame = av_frame_clone(msg->frame);
+    }
+    pthis->last_ready_hash = msg->payload_hash;
+    // zmq shares the payload buffer rather than copying it.
+    zmq_msg_init(&pthis->last_ready_payload);
+    zmq_msg_copy(&pthis->last_ready_payload, &msg->data_msg);
+    pthis->has_last_ready_payload = 1;
+  }
+}
+
+// The hash only says two payloads are probably the same. Check the bytes
+// before handing out a frame decoded from something else.
+static char is_last_ready_payload(struct horseman_s* pthis,
+                                  struct horseman_msg_s* msg)
+{
+  return pthis->has_last_ready_payload && msg->has_data && msg->payload_hash == pthis->last_ready_hash &&
+  msg->data_length == zmq_msg_size(&pthis->last_ready_payload) &&
+  !memcmp(msg->data, zmq_msg_data(&pthis->last_ready_payload),
+          msg->data_length);
+}
+
+// A duplicate is released by reference to the frame decoded from the same
+// payload, which is always the last one released before it. If that decode
+// failed, so would this one, and it goes out without a frame as well. Should
+// the bytes differ despite the hash, it is dropped rather than decoded late:
+// ordered release would stall behind it.
+static void resolve_duplicate(struct horseman_s* pthis,
+                              struct horseman_msg_s* msg)
+{
+  if (!is_last_ready_payload(pthis, msg)) {
+    msg->is_duplicate = 0;
+    msg->is_dropped = 1;
+    __atomic_add_fetch(&pthis->dropped_count, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if (pthis->last_ready_frame) {
+    msg->frame = av_frame_clone(pthis->last_ready_frame);
+    __atomic_add_fetch(&pthis->reused_count, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void reorder_release(struct horseman_s* pthis) {
+  while (pthis->reorder_head &&
+         pthis->reorder_head->sequence == pthis->next_sequence_out)
+  {
+    struct horseman_msg_s* msg = pthis->reorder_head;
+    pthis->reorder_head = msg->next;
+    msg->next = NULL;
+    if (msg->is_duplicate) {
+      resolve_duplicate(pthis, msg);
+    }
+    pthis->next_sequence_out++;
+    if (!msg->is_dropped) {
+      remember_ready_frame(pthis, msg);
+      if (pthis->on_video_ready) {
+        pthis->on_video_ready(pthis, msg, pthis->callback_p);
+      }
+    }
+    horseman_msg_free(msg);
+    decrement_work_count(pthis);
+  }
+}
+
+static void dispatch_pending(struct horseman_s* pthis);
+
 static void after_video_msg(uv_work_t* work, int status) {
-  struct msg_dispatch_s* msg = (struct msg_dispatch_s*) work->data;
-  decrement_work_count(msg->horseman);
-  horseman_msg_free(msg->msg);
-  free(msg);
+  struct msg_dispatch_s* async_msg = (struct msg_dispatch_s*) work->data;
+  struct horseman_s* pthis = async_msg->horseman;
+  pthis->in_flight_count--;
+  reorder_insert(pthis, async_msg->msg);
+  free(async_msg);
+  dispatch_pending(pthis);
+  reorder_release(pthis);
+}
+
+static void dispatch_video_job(struct horseman_s* pthis,
+                               struct horseman_msg_s* msg)
+{
+  struct msg_dispatch_s* async_msg = (struct msg_dispatch_s*)
+  calloc(1, sizeof(struct msg_dispatch_s));
+  async_msg->msg = msg;
+  async_msg->horseman = pthis;
+  async_msg->work.data = async_msg;
+  int ret = uv_queue_work(pthis->loop, &async_msg->work,
+                          dispatch_video_msg, after_video_msg);
+  if (ret) {
+    // job rejected. don't wait for after_msg to fire, but keep the sequence
+    // moving so later frames are not held up behind this one.
+    printf("horseman: failed to queue screencast %"PRIu64"\n", msg->sequence);
+    free(async_msg);
+    reorder_insert(pthis, msg);
+    reorder_release(pthis);
+  } else {
+    pthis->in_flight_count++;
+  }
+}
+
+static struct horseman_msg_s* pending_pop(struct horseman_s* pthis) {
+  struct horseman_msg_s* msg = pthis->pending_head;
+  if (msg) {
+    pthis->pending_head = msg->next;
+    if (!pthis->pending_head) {
+      pthis->pending_tail = NULL;
+    }
+    msg->next = NULL;
+    pthis->pending_count--;
+  }
+  return msg;
+}
+
+static void pending_push(struct horseman_s* pthis,
+                         struct horseman_msg_s* msg)
+{
+  msg->next = NULL;
+  if (pthis->pending_tail) {
+    pthis->pending_tail->next = msg;
+  } else {
+    pthis->pending_head = msg;
+  }
+  pthis->pending_tail = msg;
+  pthis->pending_count++;
+}
+
+// Keep decode slots busy, and shed the oldest undecoded frames once more
+// are waiting than we are willing to hold. video_frame_buffer would discard
+// most of them anyway: a newer frame supersedes them for the same slot.
+static void dispatch_pending(struct horseman_s* pthis) {
+  int64_t dropped = 0;
+  while (pthis->pending_head &&
+         pthis->pending_count + pthis->in_flight_count >
+         pthis->max_queued_frames)
+  {
+    struct horseman_msg_s* msg = pending_pop(pthis);
+    msg->is_dropped = 1;
+    // the payload is dead weight now; only the sequence number has to wait
+    // its turn in the reorder list.
+    zmq_msg_close(&msg->data_msg);
+    msg->has_data = 0;
+    reorder_insert(pthis, msg);
+    dropped++;
+  }
+  if (dropped) {
+    int64_t total = __atomic_add_fetch(&pthis->dropped_count, dropped,
+                                       __ATOMIC_SEQ_CST);
+    printf("horseman: decode is behind. dropped %"PRId64" frames "
+           "(%"PRId64" total)\n",
+           dropped, total);
+  }
+  while (pthis->pending_head && pthis->in_flight_count < pthis->max_in_flight)
+  {
+    struct horseman_msg_s* msg = pending_pop(pthis);
+    // Asked only now, in receive order, so the planner never hands a slot to
+    // a frame that admission control then drops. The next frame gets it.
+    if (pthis->should_decode &&
+        !pthis->should_decode(pthis, msg, pthis->callback_p))
+    {
+      // Superseded before it was ever decoded. Same path as a dropped
+      // frame, minus the decode backlog to blame.
+      msg->is_dropped = 1;
+      zmq_msg_close(&msg->data_msg);
+      msg->has_data = 0;
+      __atomic_add_fetch(&pthis->coalesced_count, 1, __ATOMIC_SEQ_CST);
+      reorder_insert(pthis, msg);
+      continue;
+    }
+    // Static pages resend the same image over and over. Those skip the pool,
+    // and wait in line for the frame decoded from the same bytes. Compared
+    // here rather than on receipt, so the frame they refer to is never one
+    // that admission control dropped.
+    if (pthis->has_last_decoded &&
+        msg->payload_hash == pthis->last_decoded_hash)
+    {
+      msg->is_duplicate = 1;
+      __atomic_add_fetch(&pthis->duplicate_count, 1, __ATOMIC_SEQ_CST);
+      reorder_insert(pthis, msg);
+      continue;
+    }
+    pthis->last_decoded_hash = msg->payload_hash;
+    pthis->has_last_decoded = 1;
+    dispatch_video_job(pthis, msg);
+  }
 }
 
 static int receive_screencast(struct horseman_s* pthis, char* got_message) {
   struct horseman_msg_s* msg = calloc(1, sizeof(struct horseman_msg_s));
-  // wait for zmq message
-  int ret = receive_message(pthis->screencast_socket, msg, got_message);
+  int ret = receive_message(pthis->screencast_socket, msg, legacy_parts,
+                            got_message);
   // process message
-  if (ret) {
-    printf("trouble? %d %d\n", ret, errno);
-  } else if (*got_message) {
-    printf("received screencast  ts=%f\n",
-           msg->timestamp);
-
-    struct msg_dispatch_s* async_msg = (struct msg_dispatch_s*)
-    calloc(1, sizeof(struct msg_dispatch_s));
-    async_msg->msg = msg;
-    async_msg->horseman = pthis;
-    async_msg->work.data = async_msg;
-    increment_work_count(pthis);
-    ret = uv_queue_work(pthis->loop, &async_msg->work,
-                        dispatch_video_msg, after_video_msg);
+  if (ret || !*got_message || !msg->has_data) {
     if (ret) {
-      // job rejected. don't wait for after_msg to fire
-      decrement_work_count(pthis);
+      printf("trouble? %d %d\n", ret, errno);
+    } else if (*got_message) {
+      printf("horseman: dropping screencast without payload\n");
     }
+    horseman_msg_free(msg);
+  } else {
+    // Sequence numbers are handed out here, in arrival order, so the loop
+    // thread can put decoded frames back in order later.
+    msg->sequence = pthis->next_sequence++;
+    __atomic_add_fetch(&pthis->received_count, 1, __ATOMIC_SEQ_CST);
+    printf("received screencast %"PRIu64" ts=%f %s\n", msg->sequence,
+           msg->timestamp,
+           HORSEMAN_PAYLOAD_RAW == msg->payload_type ? "raw" : "base64");
+    increment_work_count(pthis);
+    msg->payload_hash = payload_hash(msg->data, msg->data_length);
+    // duplicates included: they count against the backlog like the rest
+    pending_push(pthis, msg);
   }
   return ret;
 }
 
-static void horseman_zmq_main(void* p) {
-  int ret;
-  printf("media queue is online %p\n", p);
-  struct horseman_s* pthis = (struct horseman_s*)p;
-  int t = 10;
-  ret = zmq_connect(pthis->screencast_socket, "ipc:///tmp/ichabod-screencast");
-  ret = zmq_connect(pthis->blobsink_socket, "ipc:///tmp/ichabod-blobsink");
+static int receive_blob(struct horseman_s* pthis, char* got_message) {
+  struct horseman_msg_s* msg = calloc(1, sizeof(struct horseman_msg_s));
+  int ret = receive_message(pthis->blobsink_socket, msg, blob_parts,
+                            got_message);
+  // Blobs are passed along as they arrive; they are not decoded here and so
+  // skip the worker pool and reordering. Anything without a handler is still
+  // read, so the sender never blocks on a full socket.
+  if (!ret && *got_message && msg->has_data && msg->sz_sid &&
+      pthis->on_blob_msg)
+  {
+    pthis->on_blob_msg(pthis, msg, pthis->callback_p);
+  } else if (ret) {
+    printf("trouble? %d %d\n", ret, errno);
+  }
+  horseman_msg_free(msg);
+  return ret;
+}
+
+// ZMQ_FD only signals edges, so keep reading until ZMQ_EVENTS says the
+// socket is empty. Anything less can leave messages stranded until the next
+// unrelated wakeup.
+static char socket_is_readable(void* socket) {
+  int events = 0;
+  size_t events_size = sizeof(events);
+  int ret = zmq_getsockopt(socket, ZMQ_EVENTS, &events, &events_size);
+  return !ret && (events & ZMQ_POLLIN);
+}
+
+static void on_screencast_readable(uv_poll_t* handle, int status, int events)
+{
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  char got_message = 1;
+  while (got_message && socket_is_readable(pthis->screencast_socket)) {
+    int ret = receive_screencast(pthis, &got_message);
+    if (ret) {
+      break;
+    }
+  }
+  // Everything that arrived in this wakeup is pending now. Admission control
+  // and dispatch see the whole batch at once.
+  dispatch_pending(pthis);
+  reorder_release(pthis);
+}
+
+static void on_blobsink_readable(uv_poll_t* handle, int status, int events) {
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  char got_message = 1;
+  while (got_message && socket_is_readable(pthis->blobsink_socket)) {
+    int ret = receive_blob(pthis, &got_message);
+    if (ret) {
+      break;
+    }
+  }
+}
+
+static int start_socket_poll(struct horseman_s* pthis, void* socket,
+                             uv_poll_t* poll, uv_poll_cb callback)
+{
+  int fd;
+  size_t fd_size = sizeof(fd);
+  int ret = zmq_getsockopt(socket, ZMQ_FD, &fd, &fd_size);
   if (ret) {
-    printf("failed to connect to media queue socket. errno %d\n", errno);
-    return;
+    printf("horseman: unable to get socket fd. errno %d\n", errno);
+    return ret;
   }
-  ret = zmq_setsockopt(pthis->screencast_socket, ZMQ_RCVTIMEO, &t, sizeof(int));
-  ret = zmq_setsockopt(pthis->blobsink_socket, ZMQ_RCVTIMEO, &t, sizeof(int));
-  while (!pthis->is_interrupted) {
-    char got_screencast = 0;
-    ret = receive_screencast(pthis, &got_screencast);
+  ret = uv_poll_init(pthis->loop, poll, fd);
+  if (ret) {
+    return ret;
   }
-  zmq_close(pthis->screencast_socket);
-  zmq_close(pthis->blobsink_socket);
+  poll->data = pthis;
+  return uv_poll_start(poll, UV_READABLE, callback);
+}
+
+static void on_stop(uv_async_t* handle) {
+  struct horseman_s* pthis = (struct horseman_s*)handle->data;
+  // Stop receiving. Work already on the pool still completes, and uv_run
+  // keeps going until it does.
+  uv_close((uv_handle_t*)&pthis->screencast_poll, NULL);
+  uv_close((uv_handle_t*)&pthis->blobsink_poll, NULL);
+  uv_close((uv_handle_t*)&pthis->stop_async, NULL);
+}
+
+static void horseman_loop_main(void* p) {
+  struct horseman_s* pthis = (struct horseman_s*)p;
+  int ret = 0;
+  // Anything that arrived before the poll handles started will not raise
+  // another edge on ZMQ_FD. Drain once by hand before waiting on it.
+  on_screencast_readable(&pthis->screencast_poll, 0, UV_READABLE);
+  on_blobsink_readable(&pthis->blobsink_poll, 0, UV_READABLE);
+  while (pthis->is_running && 0 == ret) {
+    ret = uv_run(pthis->loop, UV_RUN_DEFAULT);
+  }
+  printf("horseman: exiting worker loop\n");
 }
 
 void horseman_load_config(struct horseman_s* pthis,
                              struct horseman_config_s* config)
 {
   pthis->on_video_msg = config->on_video_msg;
+  pthis->on_video_ready = config->on_video_ready;
+  pthis->on_blob_msg = config->on_blob_msg;
+  pthis->should_decode = config->should_decode;
   pthis->callback_p = config->p;
+  if (config->max_queued_frames > 0) {
+    pthis->max_queued_frames = config->max_queued_frames;
+  }
 }
 
 int horseman_alloc(struct horseman_s** queue) {
@@ -203,7 +637,6 @@ int horseman_alloc(struct horseman_s** queue) {
   pthis->zmq_ctx = zmq_ctx_new();
   pthis->screencast_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PULL);
   pthis->blobsink_socket = zmq_socket(pthis->zmq_ctx, ZMQ_PULL);
-  uv_mutex_init(&pthis->work_lock);
 
   // shape the thread pool a bit
   uv_cpu_info_t* cpu_infos;
@@ -215,48 +648,89 @@ int horseman_alloc(struct horseman_s** queue) {
   uv_free_cpu_info(cpu_infos, cpu_count);
   // ...or, don't. your mileage may vary. see what works for you.
   setenv("UV_THREADPOOL_SIZE", str, 0);
+  // Only hand the pool as many frames as it has threads. Anything beyond
+  // that waits with us, where it can still be dropped cheaply.
+  pthis->max_in_flight = atoi(getenv("UV_THREADPOOL_SIZE"));
+  if (pthis->max_in_flight < 1) {
+    pthis->max_in_flight = cpu_count;
+  }
+  pthis->max_queued_frames = HORSEMAN_DEFAULT_MAX_QUEUED_FRAMES;
   pthis->loop = (uv_loop_t*) malloc(sizeof(uv_loop_t));
   uv_loop_init(pthis->loop);
+  uv_async_init(pthis->loop, &pthis->stop_async, on_stop);
+  pthis->stop_async.data = pthis;
 
   *queue = pthis;
   return 0;
 }
 
 void horseman_free(struct horseman_s* pthis) {
-  int ret;
-  pthis->is_running = 0;
-  uv_stop(pthis->loop);
   free(pthis->loop);
-  uv_thread_join(&pthis->zmq_thread);
   zmq_ctx_destroy(pthis->zmq_ctx);
-  uv_mutex_destroy(&pthis->work_lock);
   free(pthis);
 }
 
 int horseman_start(struct horseman_s* pthis) {
-  pthis->is_interrupted = 0;
+  int ret;
+  ret = zmq_connect(pthis->screencast_socket, "ipc:///tmp/ichabod-screencast");
+  ret |= zmq_connect(pthis->blobsink_socket, "ipc:///tmp/ichabod-blobsink");
+  if (ret) {
+    printf("failed to connect to media queue socket. errno %d\n", errno);
+    return ret;
+  }
+  // Sockets are only touched from the loop thread from here on out.
+  ret = start_socket_poll(pthis, pthis->screencast_socket,
+                          &pthis->screencast_poll, on_screencast_readable);
+  ret |= start_socket_poll(pthis, pthis->blobsink_socket,
+                           &pthis->blobsink_poll, on_blobsink_readable);
+  if (ret) {
+    printf("horseman: failed to poll media queue sockets\n");
+    return ret;
+  }
+  printf("media queue is online %p\n", pthis);
   pthis->is_running = 1;
-  int ret = uv_thread_create(&pthis->zmq_thread, horseman_zmq_main, pthis);
-  int get = uv_thread_create(&pthis->loop_thread, horseman_loop_main, pthis);
-  return ret | get;
+  return uv_thread_create(&pthis->loop_thread, horseman_loop_main, pthis);
 }
 
 int horseman_stop(struct horseman_s* pthis) {
-  int ret;
-  pthis->is_interrupted = 1;
+  // uv_run returns once every handle is closed and the remaining decode jobs
+  // have completed and been released, so the loop is idle by the time we
+  // close it.
   pthis->is_running = 0;
-  int drain_count = 0;
-  // drain the work queue before calling uv_loop_close.
-  // don't wait for more than a second.
-  // _loop_close will crash if there are executing jobs, but at this point
-  // there's not much we can do about it
-  while(get_work_count(pthis) > 0 && drain_count < 1000) {
-    usleep(1000);
-  }
-  do {
-    ret = uv_loop_close(pthis->loop);
-  } while (UV_EBUSY == ret);
-  ret = uv_thread_join(&pthis->zmq_thread);
-  int get = uv_thread_join(&pthis->loop_thread);
-  return ret | get;
+  uv_async_send(&pthis->stop_async);
+  int ret = uv_thread_join(&pthis->loop_thread);
+  uv_loop_close(pthis->loop);
+  av_frame_free(&pthis->last_ready_frame);
+  if (pthis->has_last_ready_payload) {
+    zmq_msg_close(&pthis->last_ready_payload);
+    pthis->has_last_ready_payload = 0;
+  }
+  struct horseman_stats_s stats;
+  horseman_get_stats(pthis, &stats);
+  printf("horseman: %"PRId64" frames received, %"PRId64" dropped, "
+         "%"PRId64" coalesced, %"PRId64" reused without decoding "
+         "(%.1f%% hit rate)\n",
+         stats.frames_received, stats.frames_dropped, stats.frames_coalesced,
+         stats.frames_reused,
+         stats.frames_received ?
+         100.0 * stats.frames_reused / stats.frames_received : 0.0);
+  zmq_close(pthis->screencast_socket);
+  zmq_close(pthis->blobsink_socket);
+  return ret;
+}
+
+void horseman_get_stats(struct horseman_s* pthis,
+                        struct horseman_stats_s* stats)
+{
+  stats->frames_received =
+  __atomic_load_n(&pthis->received_count, __ATOMIC_SEQ_CST);
+  stats->frames_dropped =
+  __atomic_load_n(&pthis->dropped_count, __ATOMIC_SEQ_CST);
+  stats->frames_outstanding = get_work_count(pthis);
+  stats->frames_duplicate =
+  __atomic_load_n(&pthis->duplicate_count, __ATOMIC_SEQ_CST);
+  stats->frames_reused =
+  __atomic_load_n(&pthis->reused_count, __ATOMIC_SEQ_CST);
+  stats->frames_coalesced =
+  __atomic_load_n(&pthis->coalesced_count, __ATOMIC_SEQ_CST);
 }
@@ -8,26 +8,119 @@
 #ifndef horseman_h
 #define horseman_h
 
+#include <zmq.h>
 #include <libavformat/avformat.h>
 #include <libavutil/frame.h>
 
 /**
  * Message broker between this process and the horseman, via ZMQ.
+ *
+ * Screencast messages come in one of two multipart layouts, detected per
+ * message:
+ *
+ * legacy: [base64 image] [timestamp in ms, as text] [session id]
+ * binary: [header] [raw png/jpeg bytes] [session id]
+ *
+ * Blobsink messages carry chunks of a subscriber's recorded media stream:
+ *
+ * blob: [media bytes] [subscriber id]
+ *
+ * The binary header is HORSEMAN_HEADER_SIZE bytes, little endian:
+ *   char     magic[4]   "ICHB"
+ *   uint8_t  version    HORSEMAN_PROTOCOL_VERSION
+ *   uint8_t  flags      HORSEMAN_FLAG_* bits
+ *   uint16_t reserved
+ *   int64_t  timestamp  microseconds
+ *   uint32_t width      image width hint, if HORSEMAN_FLAG_SIZE_HINT
+ *   uint32_t height     image height hint, if HORSEMAN_FLAG_SIZE_HINT
+ *
+ * The size hints are not used: decoders read the size from the image itself.
+ * Messages with a binary header of any other version are dropped.
  */
 
+#define HORSEMAN_PROTOCOL_VERSION 1
+#define HORSEMAN_HEADER_SIZE 24
+#define HORSEMAN_FLAG_SIZE_HINT 0x01
+
 struct horseman_s;
 
+enum horseman_payload_e {
+  HORSEMAN_PAYLOAD_BASE64 = 0,
+  HORSEMAN_PAYLOAD_RAW
+};
+
 struct horseman_msg_s {
-  char* sz_data;
+  // Payload stays in the zmq message it was received into. data/data_length
+  // are a view into it, valid for the lifetime of this struct.
+  zmq_msg_t data_msg;
+  char has_data;
+  const uint8_t* data;
+  size_t data_length;
+  enum horseman_payload_e payload_type;
+  // milliseconds, regardless of wire format
   double timestamp;
   char* sz_sid;
+  // assigned in receive order, starting from zero
+  uint64_t sequence;
+  // decode result, filled in by on_video_msg. freed with the message unless
+  // on_video_ready takes ownership (and clears it).
+  AVFrame* frame;
+  // set when admission control gave up on decoding this message
+  char is_dropped;
+  // hash of the payload bytes, as received
+  uint64_t payload_hash;
+  // payload hash matches the last message sent to decode before this one.
+  // released with a reference to that frame if the bytes match too, and
+  // dropped otherwise.
+  char is_duplicate;
+  struct horseman_msg_s* next;
 };
 
 struct horseman_config_s {
+  // Runs on the worker pool, concurrently with other messages. Decode here.
   void (*on_video_msg)(struct horseman_s* queue,
                        struct horseman_msg_s* msg,
                        void* p);
+  // Runs on the horseman loop thread, one message at a time and strictly in
+  // sequence order, once on_video_msg has finished with the message.
+  // Duplicates skip on_video_msg: their frame is a new reference to the
+  // previous frame's buffers, so frame data must be treated as read-only.
+  void (*on_video_ready)(struct horseman_s* queue,
+                         struct horseman_msg_s* msg,
+                         void* p);
+  // Runs on the horseman loop thread for each blobsink message, in arrival
+  // order. msg and its data are only valid for the duration of the call.
+  void (*on_blob_msg)(struct horseman_s* queue,
+                      struct horseman_msg_s* msg,
+                      void* p);
+  // Optional. Runs on the horseman loop thread, in receive order, for every
+  // screencast that admission control lets through, just before it would be
+  // decoded. Returning zero drops the message without decoding it; it is
+  // never passed to on_video_ready.
+  char (*should_decode)(struct horseman_s* queue,
+                        struct horseman_msg_s* msg,
+                        void* p);
   void* p;
+  // Cap on screencasts received but not yet decoded, including those being
+  // decoded right now. Past this, the oldest undecoded frames are dropped.
+  // Zero picks a default.
+  int max_queued_frames;
+};
+
+struct horseman_stats_s {
+  int64_t frames_received;
+  // undecoded frames dropped, by admission control or (rarely) because a
+  // duplicate did not match the bytes it was taken for
+  int64_t frames_dropped;
+  // received, but not yet released through on_video_ready
+  int64_t frames_outstanding;
+  // same payload as the last frame decoded before them
+  int64_t frames_duplicate;
+  // released by reference to the previous frame, skipping decode. the hit
+  // rate is frames_reused / frames_received.
+  int64_t frames_reused;
+  // turned away by should_decode, still compressed
+  int64_t frames_coalesced;
 };
 
 int horseman_alloc(struct horseman_s** queue);
@@ -37,5 +130,8 @@ void horseman_free(struct horseman_s* queue);
 
 int horseman_start(struct horseman_s* queue);
 int horseman_stop(struct horseman_s* queue);
+/** Safe to call from any thread. */
+void horseman_get_stats(struct horseman_s* queue,
+                        struct horseman_stats_s* stats);
 
 #endif /* horseman_h */
@@ -15,21 +15,45 @@
 #include "frame_generator.h"
 #include "file_writer.h"
 #include "pulse_audio_source.h"
+#include "blob_audio_source.h"
+#include "video_frame_buffer.h"
 #include "streamer.h"
 
+#define ICHABOD_VIDEO_FPS 30
+// seconds a still picture goes without a repeat, in variable frame rate mode
+#define ICHABOD_MAX_FRAME_INTERVAL 1.0
+// seconds the mixer may hold a frame back to interleave the output
+#define ICHABOD_MAX_LATENCY 2.0
+
 struct ichabod_s {
   struct horseman_s* horseman;
   struct archive_mixer_s* mixer;
   struct file_writer_t* file_writer;
   struct pulse_s* pulse_audio;
+  struct blob_audio_s* blob_audio;
+  struct frame_generator_s* frame_generator;
   uv_thread_t thread;
   char is_running;
   char is_interrupted;
-  uv_mutex_t mixer_lock;
   const char* output_path;
   struct streamer_s* streamer;
   char use_streamer;
+  // file outputs only
+  char variable_frame_rate;
+  double max_frame_interval;
+  double max_latency;
   int width, height;
+  // Mirror of the mixer's constant frame rate grid, run on screencast
+  // timestamps before decode. Set up along with the mixer. Horseman loop
+  // thread only.
+  struct frame_grid_s decode_grid;
+  double decode_grid_origin;
+  char has_decode_grid;
+  // grid as it was before the last frame admitted, and that frame's
+  // sequence number, to give its slot back if it fails to decode
+  struct frame_grid_s decode_grid_undo;
+  uint64_t decode_grid_sequence;
+  char has_decode_grid_undo;
 };
 
 static int build_output(struct ichabod_s* pthis) {
@@ -63,8 +87,10 @@ static int build_mixer(struct ichabod_s* pthis, AVFrame* first_video_frame,
     return ret;
   }
   struct archive_mixer_config_s mixer_config;
-  mixer_config.min_buffer_time = 2; // does this need to be configurable?
-  mixer_config.video_fps_out = 30; // this too?
+  mixer_config.min_buffer_time = pthis->max_latency;
+  mixer_config.video_fps_out = ICHABOD_VIDEO_FPS; // this too?
+  mixer_config.variable_frame_rate = pthis->variable_frame_rate;
+  mixer_config.max_frame_interval = pthis->max_frame_interval;
   if (pthis->use_streamer) {
     mixer_config.audio_ctx_out = pthis->streamer->audio_context;
     mixer_config.audio_stream_out = pthis->streamer->audio_stream;
@@ -85,6 +111,16 @@ static int build_mixer(struct ichabod_s* pthis, AVFrame* first_video_frame,
     printf("ichabod: cannot build mixer\n");
     return ret;
   }
+  if (!pthis->variable_frame_rate) {
+    // Same origin and slot length as the mixer's frame buffer, where the
+    // first frame is about to take the slot at pts zero.
+    frame_grid_init(&pthis->decode_grid,
+                    (double)mixer_config.video_ctx_out->time_base.den /
+                    mixer_config.video_fps_out);
+    frame_grid_admit(&pthis->decode_grid, 0);
+    pthis->decode_grid_origin = initial_timestamp;
+    pthis->has_decode_grid = 1;
+  }
   ret = pulse_start(pthis->pulse_audio);
   if (ret) {
     printf("failed to open pulse audio! ichabod will be silent.\n");
@@ -101,30 +137,88 @@ static void on_audio_data(struct pulse_s* pulse, void* p) {
   archive_mixer_drain_audio(pthis->mixer);
 }
 
+static char should_decode(struct horseman_s* queue,
+                          struct horseman_msg_s* msg, void* p)
+{
+  struct ichabod_s* pthis = (struct ichabod_s*)p;
+  if (pthis->variable_frame_rate) {
+    // every frame is kept
+    return 1;
+  }
+  // The mixer's frame buffer keeps only the first frame to reach each output
+  // slot. Run the same placement on timestamps alone, so frames it would
+  // throw away are never decoded. Until the mixer exists there is no grid
+  // to place on, and everything is decoded.
+  if (!pthis->has_decode_grid) {
+    return 1;
+  }
+  // same arithmetic as archive_mixer_consume_video
+  int64_t pts = msg->timestamp - (1000 * pthis->decode_grid_origin);
+  struct frame_grid_s undo = pthis->decode_grid;
+  if (!frame_grid_admit(&pthis->decode_grid, pts)) {
+    return 0;
+  }
+  pthis->decode_grid_undo = undo;
+  pthis->decode_grid_sequence = msg->sequence;
+  pthis->has_decode_grid_undo = 1;
+  return 1;
+}
+
 static void on_video_msg(struct horseman_s* queue,
                          struct horseman_msg_s* msg, void* p)
 {
+  // This function runs on many threads, concurrently. Only decode here;
+  // horseman hands the result back in order through on_video_ready.
   struct ichabod_s* pthis = (struct ichabod_s*)p;
-  AVFrame* frame = NULL;
-  int ret = generate_frame(msg->sz_data, &frame);
+  int ret = generate_frame(pthis->frame_generator, msg->data, msg->data_length,
+                           HORSEMAN_PAYLOAD_BASE64 == msg->payload_type,
+                           &msg->frame);
   if (ret) {
     printf("unable to extract frame from video message\n");
+    msg->frame = NULL;
+  }
+}
+
+static void on_video_ready(struct horseman_s* queue,
+                           struct horseman_msg_s* msg, void* p)
+{
+  struct ichabod_s* pthis = (struct ichabod_s*)p;
+  // Runs on a single thread in receive order, so video_frame_buffer sees
+  // monotonic timestamps without any locking here.
+  if (!msg->frame) {
+    // Give back the slot it was planned for, unless another frame has been
+    // admitted since. The next one in line can take it.
+    if (pthis->has_decode_grid_undo &&
+        msg->sequence == pthis->decode_grid_sequence)
+    {
+      pthis->decode_grid = pthis->decode_grid_undo;
+      pthis->has_decode_grid_undo = 0;
+    }
+    return;
+  }
+  if (pthis->variable_frame_rate && msg->is_duplicate) {
+    // the picture on screen already lasts until the next change
     return;
   }
-  // This function runs on many threads, concurrently. The archive mixer
-  // knows how to reorder frames, but video_frame_buffer definitely does not.
-  // If you notice out-of-order video frames arriving in the archive, this
-  // needs to be fixed to enforce ordering. (tip: the consume video function
-  // can run on a single thread without any hassle).
-  uv_mutex_lock(&pthis->mixer_lock);
   if (!pthis->mixer) {
-    ret = build_mixer(pthis, frame,
-                      /* hardcode time units from chrome screencast */
-                      msg->timestamp / 1000);
+    int ret = build_mixer(pthis, msg->frame,
+                          /* hardcode time units from chrome screencast */
+                          msg->timestamp / 1000);
     assert(!ret);
   }
-  archive_mixer_consume_video(pthis->mixer, frame, msg->timestamp);
-  uv_mutex_unlock(&pthis->mixer_lock);
+  archive_mixer_consume_video(pthis->mixer, msg->frame, msg->timestamp);
+  msg->frame = NULL;
+}
+
+static void on_blob_msg(struct horseman_s* queue,
+                        struct horseman_msg_s* msg, void* p)
+{
+  struct ichabod_s* pthis = (struct ichabod_s*)p;
+  // Subscriber streams start before the first screencast frame shows up, so
+  // they are fed regardless of whether the mixer exists yet. Losing the first
+  // chunk would lose the WebM header with it.
+  blob_audio_consume(pthis->blob_audio, msg->sz_sid, msg->data,
+                     msg->data_length);
 }
 
 void ichabod_initialize() {
@@ -140,8 +234,11 @@ void ichabod_alloc(struct ichabod_s** pout) {
   calloc(1, sizeof(struct ichabod_s));
   file_writer_alloc(&pthis->file_writer);
   horseman_alloc(&pthis->horseman);
-  struct horseman_config_s horseman_config;
+  struct horseman_config_s horseman_config = {0};
   horseman_config.on_video_msg = on_video_msg;
+  horseman_config.on_video_ready = on_video_ready;
+  horseman_config.on_blob_msg = on_blob_msg;
+  horseman_config.should_decode = should_decode;
   horseman_config.p = pthis;
   horseman_load_config(pthis->horseman, &horseman_config);
 
@@ -152,16 +249,21 @@ void ichabod_alloc(struct ichabod_s** pout) {
   pulse_config.on_audio_data = on_audio_data;
   pulse_config.audio_data_cb_p = pthis;
   pulse_load_config(pthis->pulse_audio, &pulse_config);
-  uv_mutex_init(&pthis->mixer_lock);
+
+  // Subscriber audio has no place in the mix yet, so no consumer is
+  // configured and blob_audio ignores the chunks (no threads, no demuxers).
+  blob_audio_alloc(&pthis->blob_audio);
+  frame_generator_alloc(&pthis->frame_generator);
   *pout = pthis;
 }
 
 void ichabod_free(struct ichabod_s* pthis) {
   horseman_free(pthis->horseman);
-  uv_mutex_destroy(&pthis->mixer_lock);
+  blob_audio_free(pthis->blob_audio);
   file_writer_free(pthis->file_writer);
   archive_mixer_free(pthis->mixer);
   pthis->mixer = NULL;
+  frame_generator_free(pthis->frame_generator);
   free(pthis);
 }
 
@@ -175,12 +277,38 @@ void ichabod_load_config(struct ichabod_s* pthis,
   } else {
     pthis->use_streamer = 0;
   }
+  pthis->variable_frame_rate = config->variable_frame_rate;
+  if (pthis->variable_frame_rate && pthis->use_streamer) {
+    printf("variable frame rate is for file outputs. streaming at %d fps\n",
+           ICHABOD_VIDEO_FPS);
+    pthis->variable_frame_rate = 0;
+  }
+  pthis->max_frame_interval = config->max_frame_interval;
+  if (!pthis->max_frame_interval) {
+    pthis->max_frame_interval = ICHABOD_MAX_FRAME_INTERVAL;
+  } else if (pthis->max_frame_interval < 0) {
+    pthis->max_frame_interval = 0;
+  }
+  pthis->max_latency = config->max_latency;
+  if (!pthis->max_latency) {
+    pthis->max_latency = ICHABOD_MAX_LATENCY;
+  } else if (pthis->max_latency < 0) {
+    pthis->max_latency = 0;
+  }
+  struct frame_generator_config_s generator_config = {0};
+  generator_config.crop_x = config->crop_x;
+  generator_config.crop_y = config->crop_y;
+  generator_config.crop_width = config->crop_width;
+  generator_config.crop_height = config->crop_height;
+  generator_config.output_scale = config->output_scale;
+  frame_generator_load_config(pthis->frame_generator, &generator_config);
 }
 
 
-// Run ichabod_main cycles so long as data is queued to write AND 
+// Run ichabod_main cycles so long as data is queued to write, or more may
+// come. Queued frames may be held back for a while, so has_next won't do.
 static inline char should_try_cycle(struct ichabod_s* pthis) {
-  return (pthis->mixer && archive_mixer_has_next(pthis->mixer)) ||
+  return (pthis->mixer && archive_mixer_get_size(pthis->mixer)) ||
   !pthis->is_interrupted;
 }
 
@@ -219,6 +347,7 @@ static void ichabod_main(void* p) {
     usleep(10000);
   }
   horseman_stop(pthis->horseman);
+  blob_audio_stop(pthis->blob_audio);
   pulse_stop(pthis->pulse_audio);
   printf("ichabod main complete\n");
   if (pthis->use_streamer) {
@@ -15,6 +15,22 @@
 struct ichabod_s;
 struct ichabod_config_s {
   const char* output_path;
+  // Region of the screencast to record, in screencast pixels. Zero width or
+  // height records all of it.
+  int crop_x;
+  int crop_y;
+  int crop_width;
+  int crop_height;
+  // Record at 1/output_scale the width and height: 1, 2 or 4. Zero means 1.
+  int output_scale;
+  // File outputs only: record frames as they come instead of at a constant
+  // rate, repeating the last one after max_frame_interval seconds of
+  // nothing new. Zero picks a default; negative never repeats.
+  char variable_frame_rate;
+  double max_frame_interval;
+  // Seconds a frame may be held back so audio and video go out in order.
+  // Zero picks a default; negative writes frames as soon as they arrive.
+  double max_latency;
 };
 
 void ichabod_initialize();
@@ -27,6 +27,11 @@ int main(int argc, char* const* argv) {
   signal(SIGINT, on_signal);
 
   char* output_path = NULL;
+  int crop_x = 0, crop_y = 0, crop_width = 0, crop_height = 0;
+  int output_scale = 1;
+  char variable_frame_rate = 0;
+  double max_frame_interval = 0;
+  double max_latency = 0;
   static struct option long_options[] =
   {
     /* These options set a flag. */
@@ -34,12 +39,16 @@ int main(int argc, char* const* argv) {
     /* These options don’t set a flag.
      We distinguish them by their indices. */
     {"output", optional_argument,       0, 'o'},
+    {"crop",   required_argument,       0, 'c'},
+    {"scale",  required_argument,       0, 's'},
+    {"vfr",    optional_argument,       0, 'v'},
+    {"latency", required_argument,      0, 'l'},
     {0, 0, 0, 0}
   };
   /* getopt_long stores the option index here. */
   int option_index = 0;
 
-  while ((c = getopt_long(argc, argv, "o:",
+  while ((c = getopt_long(argc, argv, "o:c:s:v::l:",
                           long_options, &option_index)) != -1)
   {
     switch (c)
@@ -47,6 +56,56 @@ int main(int argc, char* const* argv) {
       case 'o':
         output_path = optarg;
         break;
+      case 'c':
+        // same geometry syntax as ImageMagick: WxH+X+Y
+        if (4 != sscanf(optarg, "%dx%d+%d+%d",
+                        &crop_width, &crop_height, &crop_x, &crop_y) ||
+            crop_width <= 0 || crop_height <= 0 || crop_x < 0 || crop_y < 0)
+        {
+          fprintf(stderr, "Bad crop `%s'. Expected WxH+X+Y.\n", optarg);
+          return 1;
+        }
+        break;
+      case 's':
+        // record at 1/N size
+        output_scale = atoi(optarg);
+        if (1 != output_scale && 2 != output_scale && 4 != output_scale) {
+          fprintf(stderr, "Bad scale `%s'. Expected 1, 2 or 4.\n", optarg);
+          return 1;
+        }
+        break;
+      case 'v':
+        // variable frame rate, optionally with the longest gap in seconds
+        variable_frame_rate = 1;
+        if (optarg) {
+          char* end = NULL;
+          max_frame_interval = strtod(optarg, &end);
+          if (end == optarg || *end || max_frame_interval < 0) {
+            fprintf(stderr, "Bad frame interval `%s'. Expected seconds.\n",
+                    optarg);
+            return 1;
+          }
+          if (!max_frame_interval) {
+            // no repeats at all
+            max_frame_interval = -1;
+          }
+        }
+        break;
+      case 'l':
+        // longest a frame waits for the other streams, in seconds
+        {
+          char* end = NULL;
+          max_latency = strtod(optarg, &end);
+          if (end == optarg || *end || max_latency < 0) {
+            fprintf(stderr, "Bad latency `%s'. Expected seconds.\n", optarg);
+            return 1;
+          }
+          if (!max_latency) {
+            // write frames as they come
+            max_latency = -1;
+          }
+        }
+        break;
       case '?':
         if (isprint(optopt))
           fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -67,8 +126,16 @@ int main(int argc, char* const* argv) {
   ichabod_initialize();
 
   ichabod_alloc(&ichabod);
-  struct ichabod_config_s config;
+  struct ichabod_config_s config = {0};
   config.output_path = output_path;
+  config.crop_x = crop_x;
+  config.crop_y = crop_y;
+  config.crop_width = crop_width;
+  config.crop_height = crop_height;
+  config.output_scale = output_scale;
+  config.variable_frame_rate = variable_frame_rate;
+  config.max_frame_interval = max_frame_interval;
+  config.max_latency = max_latency;
   ichabod_load_config(ichabod, &config);
   ret = ichabod_start(ichabod);
   if (ret) {
@@ -0,0 +1,259 @@
+//
+//  slice_pool.c
+//  ichabod
+//
+//  Created by Charley Robinson on 7/20/17.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <uv.h>
+#include "slice_pool.h"
+
+// keep slices big enough to be worth a context switch
+#define SLICE_MIN_ROWS 32
+// slices per worker. a few extra evens out uneven progress.
+#define SLICES_PER_WORKER 2
+
+struct slice_job_s {
+  void (*fn)(void* arg, int slice);
+  void* arg;
+  int num_slices;
+  int next_slice;
+  int slices_done;
+  struct slice_job_s* next;
+};
+
+struct slice_pool_s {
+  uv_mutex_t lock;
+  // signaled when a job is queued, or the pool is stopping
+  uv_cond_t work_cond;
+  // signaled when any job finishes its last slice
+  uv_cond_t done_cond;
+  // jobs with slices nobody has started, oldest first
+  struct slice_job_s* jobs;
+  uv_thread_t* threads;
+  int num_threads;
+  char is_running;
+};
+
+// Called with lock held.
+static int take_slice(struct slice_pool_s* pthis, struct slice_job_s* job) {
+  int slice = job->next_slice++;
+  if (job->next_slice == job->num_slices) {
+    // nothing left to hand out. the job stays alive until slices_done.
+    struct slice_job_s** link = &pthis->jobs;
+    while (*link != job) {
+      link = &(*link)->next;
+    }
+    *link = job->next;
+  }
+  return slice;
+}
+
+// Called with lock held.
+static void finish_slice(struct slice_pool_s* pthis, struct slice_job_s* job) {
+  if (++job->slices_done == job->num_slices) {
+    uv_cond_broadcast(&pthis->done_cond);
+  }
+}
+
+static void slice_worker_main(void* p) {
+  struct slice_pool_s* pthis = (struct slice_pool_s*)p;
+  uv_mutex_lock(&pthis->lock);
+  while (1) {
+    while (pthis->is_running && !pthis->jobs) {
+      uv_cond_wait(&pthis->work_cond, &pthis->lock);
+    }
+    if (!pthis->jobs) {
+      break;
+    }
+    struct slice_job_s* job = pthis->jobs;
+    int slice = take_slice(pthis, job);
+    uv_mutex_unlock(&pthis->lock);
+    job->fn(job->arg, slice);
+    uv_mutex_lock(&pthis->lock);
+    finish_slice(pthis, job);
+  }
+  uv_mutex_unlock(&pthis->lock);
+}
+
+int slice_pool_alloc(struct slice_pool_s** pool, int num_threads) {
+  struct slice_pool_s* pthis = (struct slice_pool_s*)
+  calloc(1, sizeof(struct slice_pool_s));
+  if (!pthis) {
+    return -1;
+  }
+  if (num_threads <= 0) {
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  }
+  uv_mutex_init(&pthis->lock);
+  uv_cond_init(&pthis->work_cond);
+  uv_cond_init(&pthis->done_cond);
+  pthis->is_running = 1;
+  if (num_threads > 0) {
+    pthis->threads = calloc(num_threads, sizeof(uv_thread_t));
+  }
+  for (int i = 0; pthis->threads && i < num_threads; i++) {
+    if (uv_thread_create(&pthis->threads[i], slice_worker_main, pthis)) {
+      printf("slice_pool: started %d of %d threads\n", i, num_threads);
+      break;
+    }
+    pthis->num_threads++;
+  }
+  *pool = pthis;
+  return 0;
+}
+
+void slice_pool_free(struct slice_pool_s* pthis) {
+  if (!pthis) {
+    return;
+  }
+  uv_mutex_lock(&pthis->lock);
+  pthis->is_running = 0;
+  uv_cond_broadcast(&pthis->work_cond);
+  uv_mutex_unlock(&pthis->lock);
+  for (int i = 0; i < pthis->num_threads; i++) {
+    uv_thread_join(&pthis->threads[i]);
+  }
+  uv_cond_destroy(&pthis->done_cond);
+  uv_cond_destroy(&pthis->work_cond);
+  uv_mutex_destroy(&pthis->lock);
+  free(pthis->threads);
+  free(pthis);
+}
+
+void slice_pool_run(struct slice_pool_s* pthis, int num_slices,
+                    void (*fn)(void* arg, int slice), void* arg)
+{
+  if (!pthis || !pthis->num_threads || num_slices < 2) {
+    for (int i = 0; i < num_slices; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+  struct slice_job_s job = { fn, arg, num_slices, 0, 0, NULL };
+  uv_mutex_lock(&pthis->lock);
+  struct slice_job_s** link = &pthis->jobs;
+  while (*link) {
+    link = &(*link)->next;
+  }
+  *link = &job;
+  uv_cond_broadcast(&pthis->work_cond);
+  // pitch in on our own job rather than sit idle
+  while (job.next_slice < job.num_slices) {
+    int slice = take_slice(pthis, &job);
+    uv_mutex_unlock(&pthis->lock);
+    fn(arg, slice);
+    uv_mutex_lock(&pthis->lock);
+    finish_slice(pthis, &job);
+  }
+  while (job.slices_done < job.num_slices) {
+    uv_cond_wait(&pthis->done_cond, &pthis->lock);
+  }
+  uv_mutex_unlock(&pthis->lock);
+}
+
+#pragma mark - Color conversion
+
+struct rgb24_yuv420_job_s {
+  rgb_yuv420_kernel_fn kernel;
+  // set instead of kernel for downscaling jobs
+  rgb24_yuv420_scaled_fn scaled_kernel;
+  uint32_t scale;
+  uint32_t width;
+  uint32_t height;
+  uint32_t slice_rows;
+  const uint8_t* rgb;
+  uint32_t rgb_stride;
+  uint8_t* y;
+  uint8_t* u;
+  uint8_t* v;
+  uint32_t y_stride;
+  uint32_t uv_stride;
+  // scaled_kernel only. kernel has its color space built in.
+  YCbCrType yuv_type;
+};
+
+static void rgb24_yuv420_slice(void* arg, int slice) {
+  struct rgb24_yuv420_job_s* job = (struct rgb24_yuv420_job_s*)arg;
+  uint32_t row = slice * job->slice_rows;
+  uint32_t rows = job->height - row;
+  if (rows > job->slice_rows) {
+    rows = job->slice_rows;
+  }
+  // row is a whole number of output row pairs, so chroma rows line up
+  uint32_t out_row = row / job->scale;
+  const uint8_t* rgb = job->rgb + row * job->rgb_stride;
+  uint8_t* y = job->y + out_row * job->y_stride;
+  uint8_t* u = job->u + (out_row / 2) * job->uv_stride;
+  uint8_t* v = job->v + (out_row / 2) * job->uv_stride;
+  if (job->scaled_kernel) {
+    job->scaled_kernel(job->scale, job->width, rows, rgb, job->rgb_stride,
+                       y, u, v, job->y_stride, job->uv_stride, job->yuv_type);
+  } else {
+    job->kernel(job->width, rows, rgb, job->rgb_stride,
+                y, u, v, job->y_stride, job->uv_stride);
+  }
+}
+
+// Splits a job into slices of whole output row pairs and runs it.
+static void rgb24_yuv420_run(struct slice_pool_s* pthis,
+                             struct rgb24_yuv420_job_s* job)
+{
+  uint32_t num_slices = (pthis->num_threads + 1) * SLICES_PER_WORKER;
+  uint32_t slice_rows = (job->height + num_slices - 1) / num_slices;
+  uint32_t row_pair = 2 * job->scale;
+  slice_rows = (slice_rows + row_pair - 1) / row_pair * row_pair;
+  if (slice_rows < SLICE_MIN_ROWS) {
+    slice_rows = SLICE_MIN_ROWS;
+  }
+  job->slice_rows = slice_rows;
+  slice_pool_run(pthis, (job->height + slice_rows - 1) / slice_rows,
+                 rgb24_yuv420_slice, job);
+}
+
+void slice_pool_rgb24_yuv420(struct slice_pool_s* pthis,
+                             rgb_yuv420_kernel_fn kernel,
+                             uint32_t width, uint32_t height,
+                             const uint8_t* rgb, uint32_t rgb_stride,
+                             uint8_t* y, uint8_t* u, uint8_t* v,
+                             uint32_t y_stride, uint32_t uv_stride)
+{
+  if (!pthis || !pthis->num_threads ||
+      (uint64_t)width * height < SLICE_POOL_MIN_PIXELS)
+  {
+    kernel(width, height, rgb, rgb_stride, y, u, v, y_stride, uv_stride);
+    return;
+  }
+  struct rgb24_yuv420_job_s job = {
+    kernel, NULL, 1, width, height, 0, rgb, rgb_stride,
+    y, u, v, y_stride, uv_stride, YCBCR_JPEG
+  };
+  rgb24_yuv420_run(pthis, &job);
+}
+
+void slice_pool_rgb24_yuv420_scaled(struct slice_pool_s* pthis,
+                                    rgb24_yuv420_scaled_fn kernel,
+                                    uint32_t scale,
+                                    uint32_t width, uint32_t height,
+                                    const uint8_t* rgb, uint32_t rgb_stride,
+                                    uint8_t* y, uint8_t* u, uint8_t* v,
+                                    uint32_t y_stride, uint32_t uv_stride,
+                                    YCbCrType yuv_type)
+{
+  // measured in source pixels: the box filter reads all of them
+  if (!pthis || !pthis->num_threads ||
+      (uint64_t)width * height < SLICE_POOL_MIN_PIXELS)
+  {
+    kernel(scale, width, height, rgb, rgb_stride, y, u, v,
+           y_stride, uv_stride, yuv_type);
+    return;
+  }
+  struct rgb24_yuv420_job_s job = {
+    NULL, kernel, scale, width, height, 0, rgb, rgb_stride,
+    y, u, v, y_stride, uv_stride, yuv_type
+  };
+  rgb24_yuv420_run(pthis, &job);
+}
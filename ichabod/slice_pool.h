@@ -0,0 +1,60 @@
+//
+//  slice_pool.h
+//  ichabod
+//
+//  Created by Charley Robinson on 7/20/17.
+//
+
+#ifndef slice_pool_h
+#define slice_pool_h
+
+#include <stdint.h>
+#include "yuv_rgb.h"
+
+/**
+ * Fork-join worker pool for splitting one large job into slices. The calling
+ * thread works on its own job alongside the pool threads and returns once
+ * every slice is done, so callers see a plain blocking function. Any number
+ * of threads may run jobs on the same pool at once.
+ */
+struct slice_pool_s;
+
+/**
+ * @param num_threads pool threads to start, besides the callers. Zero picks
+ * one less than the number of cores.
+ */
+int slice_pool_alloc(struct slice_pool_s** pool, int num_threads);
+void slice_pool_free(struct slice_pool_s* pool);
+
+/** Calls fn(arg, i) for every i in [0, num_slices), in no particular order. */
+void slice_pool_run(struct slice_pool_s* pool, int num_slices,
+                    void (*fn)(void* arg, int slice), void* arg);
+
+// pictures smaller than this are converted on the calling thread alone
+#define SLICE_POOL_MIN_PIXELS (1 << 20)
+
+/**
+ * A kernel from rgb_yuv420_kernel run in bands of whole row pairs, spread
+ * over the pool. The kernel's layout must match rgb.
+ */
+void slice_pool_rgb24_yuv420(struct slice_pool_s* pool,
+                             rgb_yuv420_kernel_fn kernel,
+                             uint32_t width, uint32_t height,
+                             const uint8_t* rgb, uint32_t rgb_stride,
+                             uint8_t* y, uint8_t* u, uint8_t* v,
+                             uint32_t y_stride, uint32_t uv_stride);
+
+/**
+ * Same, for the rgb*_yuv420_scaled kernels. width and height are the
+ * source size. Slices are whole pairs of output rows.
+ */
+void slice_pool_rgb24_yuv420_scaled(struct slice_pool_s* pool,
+                                    rgb24_yuv420_scaled_fn kernel,
+                                    uint32_t scale,
+                                    uint32_t width, uint32_t height,
+                                    const uint8_t* rgb, uint32_t rgb_stride,
+                                    uint8_t* y, uint8_t* u, uint8_t* v,
+                                    uint32_t y_stride, uint32_t uv_stride,
+                                    YCbCrType yuv_type);
+
+#endif /* slice_pool_h */
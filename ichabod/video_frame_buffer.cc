@@ -7,77 +7,183 @@
 
 extern "C" {
 
+#include <stdio.h>
 #include "video_frame_buffer.h"
 
 }
 
-#include <queue>
+// consumers drain after every frame, so only a couple are ever in use
+#define FRAME_BUFFER_MAX_RUNS 16
 
 struct frame_buffer_s {
-  std::queue<AVFrame*> buf;
-  double interval;
-  double precise_tail_pts;
+  // ring of runs, oldest at head
+  struct frame_run_s runs[FRAME_BUFFER_MAX_RUNS];
+  int head;
+  int num_runs;
+  // across all runs
+  int64_t num_slots;
+  struct frame_grid_s grid;
 };
 
+void frame_grid_init(struct frame_grid_s* grid, double pts_interval) {
+  grid->interval = pts_interval;
+  grid->precise_tail_pts = 0;
+  grid->has_tail = 0;
+}
+
+enum frame_grid_result_e frame_grid_place(struct frame_grid_s* grid,
+                                          int64_t pts, double* slot_pts)
+{
+  if (!grid->has_tail) {
+    grid->has_tail = 1;
+    grid->precise_tail_pts = pts;
+    *slot_pts = pts;
+    return FRAME_GRID_ACCEPT;
+  }
+  double next_tail_ts = grid->precise_tail_pts + grid->interval;
+  double two_frames_late = next_tail_ts + grid->interval;
+  double half_frame_early = next_tail_ts - (grid->interval / 2);
+  if (pts > two_frames_late) {
+    // Frame is late: copy old tail if more than 1 frame late
+    grid->precise_tail_pts = next_tail_ts;
+    *slot_pts = next_tail_ts;
+    return FRAME_GRID_REPEAT;
+  } else if (pts > half_frame_early) {
+    // frame is late, but not that late, or early, but not that early.
+    // mangle it and accept as is.
+    grid->precise_tail_pts = next_tail_ts;
+    *slot_pts = next_tail_ts;
+    return FRAME_GRID_ACCEPT;
+  }
+  // frame is too early to consider.
+  return FRAME_GRID_DROP;
+}
+
+char frame_grid_admit(struct frame_grid_s* grid, int64_t pts) {
+  double slot_pts;
+  enum frame_grid_result_e result;
+  do {
+    result = frame_grid_place(grid, pts, &slot_pts);
+  } while (FRAME_GRID_REPEAT == result);
+  return FRAME_GRID_ACCEPT == result;
+}
+
+static struct frame_run_s* frame_buffer_tail(struct frame_buffer_s* pthis) {
+  int i = (pthis->head + pthis->num_runs - 1) % FRAME_BUFFER_MAX_RUNS;
+  return &pthis->runs[i];
+}
+
 void frame_buffer_alloc(struct frame_buffer_s** frame_buffer_out,
                         double pts_interval)
 {
   struct frame_buffer_s* pthis = (struct frame_buffer_s*)
   calloc(1, sizeof(struct frame_buffer_s));
-  pthis->buf = std::queue<AVFrame*>();
-  pthis->interval = pts_interval;
+  frame_grid_init(&pthis->grid, pts_interval);
   *frame_buffer_out = pthis;
 }
 
 void frame_buffer_free(struct frame_buffer_s* pthis) {
-  while (!pthis->buf.empty()) {
-    AVFrame* frame = pthis->buf.front();
-    av_frame_free(&frame);
-    pthis->buf.pop();
+  while (pthis->num_runs) {
+    av_frame_free(&pthis->runs[pthis->head].frame);
+    pthis->head = (pthis->head + 1) % FRAME_BUFFER_MAX_RUNS;
+    pthis->num_runs--;
   }
   free(pthis);
 }
 
+AVFrame* frame_run_take(struct frame_run_s* run) {
+  AVFrame* frame;
+  if (run->slots > 1) {
+    // this may need to become a manual deep copy if we're not refcounting
+    frame = av_frame_clone(run->frame);
+  } else {
+    frame = run->frame;
+    run->frame = NULL;
+  }
+  if (frame) {
+    frame->pts = run->next_pts;
+  }
+  run->next_pts += run->interval;
+  run->slots--;
+  return frame;
+}
+
 int frame_buffer_get_next(struct frame_buffer_s* pthis, AVFrame** frame_out)
 {
-  if (pthis->buf.size() < 2) {
+  // the last slot stays behind, in case it has to repeat
+  if (pthis->num_slots < 2) {
     *frame_out = NULL;
     return EAGAIN;
   }
-  *frame_out = pthis->buf.front();
-  pthis->buf.pop();
+  struct frame_run_s* run = &pthis->runs[pthis->head];
+  if (1 == run->slots) {
+    pthis->head = (pthis->head + 1) % FRAME_BUFFER_MAX_RUNS;
+    pthis->num_runs--;
+  }
+  *frame_out = frame_run_take(run);
+  pthis->num_slots--;
+  return *frame_out ? 0 : ENOMEM;
+}
+
+int frame_buffer_get_next_run(struct frame_buffer_s* pthis,
+                              struct frame_run_s* run_out)
+{
+  if (pthis->num_slots < 2) {
+    return EAGAIN;
+  }
+  struct frame_run_s* run = &pthis->runs[pthis->head];
+  if (pthis->num_runs > 1) {
+    // no longer the tail, so it cannot grow
+    *run_out = *run;
+    run->frame = NULL;
+    pthis->head = (pthis->head + 1) % FRAME_BUFFER_MAX_RUNS;
+    pthis->num_runs--;
+  } else {
+    AVFrame* frame = av_frame_clone(run->frame);
+    if (!frame) {
+      return ENOMEM;
+    }
+    *run_out = *run;
+    run_out->frame = frame;
+    run_out->slots = run->slots - 1;
+    // step the same way frame_run_take does, so the pts line up exactly
+    for (int64_t i = 0; i < run_out->slots; i++) {
+      run->next_pts += run->interval;
+    }
+    run->slots = 1;
+  }
+  pthis->num_slots -= run_out->slots;
   return 0;
 }
 
 void frame_buffer_consume(struct frame_buffer_s* pthis, AVFrame* frame)
 {
-  if (pthis->buf.empty()) {
-    pthis->buf.push(frame);
-    pthis->precise_tail_pts = frame->pts;
-    return;
+  double slot_pts;
+  enum frame_grid_result_e result;
+  while (FRAME_GRID_REPEAT ==
+         (result = frame_grid_place(&pthis->grid, frame->pts, &slot_pts)))
+  {
+    // the tail shows for one more slot
+    frame_buffer_tail(pthis)->slots++;
+    pthis->num_slots++;
   }
-  double next_tail_ts = pthis->precise_tail_pts + pthis->interval;
-  double two_frames_late = next_tail_ts + pthis->interval;
-  double half_frame_early = next_tail_ts - (pthis->interval / 2);
-  AVFrame* tail = pthis->buf.back();
-  // Frame is late: copy old tail if more than 1 frame late
-  if (frame->pts > two_frames_late) {
-    // this may need to become a manual deep copy if we're not refcounting
-    AVFrame* new_tail = av_frame_clone(tail);
-    new_tail->pts = next_tail_ts;
-    pthis->precise_tail_pts = next_tail_ts;
-    pthis->buf.push(new_tail);
-    frame_buffer_consume(pthis, frame);
-  } else if (frame->pts > next_tail_ts) {
-    // frame is late, but not that late: mangle it and accept as is.
-    frame->pts = next_tail_ts;
-    pthis->precise_tail_pts = next_tail_ts;
-    pthis->buf.push(frame);
-  } else if (frame->pts > half_frame_early) {
-    // frame is early, but not that early. mangle it and accept as is.
-    frame->pts = next_tail_ts;
-    pthis->precise_tail_pts = next_tail_ts;
-    pthis->buf.push(frame);
+  if (FRAME_GRID_ACCEPT == result &&
+      FRAME_BUFFER_MAX_RUNS == pthis->num_runs)
+  {
+    // nobody is reading. hold the tail over rather than grow.
+    printf("frame buffer: %d runs unread, dropping frame\n", pthis->num_runs);
+    frame_buffer_tail(pthis)->slots++;
+    pthis->num_slots++;
+    av_frame_free(&frame);
+  } else if (FRAME_GRID_ACCEPT == result) {
+    struct frame_run_s* run = &pthis->runs[(pthis->head + pthis->num_runs) %
+                                           FRAME_BUFFER_MAX_RUNS];
+    run->frame = frame;
+    run->next_pts = slot_pts;
+    run->interval = pthis->grid.interval;
+    run->slots = 1;
+    pthis->num_runs++;
+    pthis->num_slots++;
   } else {
     // frame is too early to consider. toss it out with yesterday's garbage.
     av_frame_free(&frame);
@@ -85,5 +191,5 @@ void frame_buffer_consume(struct frame_buffer_s* pthis, AVFrame* frame)
 }
 
 char frame_buffer_has_next(struct frame_buffer_s* pthis) {
-  return pthis->buf.size() > 1;
+  return pthis->num_slots > 1;
 }
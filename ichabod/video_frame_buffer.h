@@ -10,9 +10,57 @@
 
 #include <libavutil/frame.h>
 
+/**
+ * Placement of timestamps on a constant rate grid. This is the policy the
+ * frame buffer below applies to real frames; it only needs timestamps, so it
+ * can also be run ahead of time on frames that are not decoded yet.
+ */
+struct frame_grid_s {
+  double interval;
+  double precise_tail_pts;
+  char has_tail;
+};
+
+enum frame_grid_result_e {
+  // too early for the next slot: a frame is already there
+  FRAME_GRID_DROP = 0,
+  // takes the next slot, at *slot_pts
+  FRAME_GRID_ACCEPT,
+  // too late: the current tail repeats at *slot_pts first. place again.
+  FRAME_GRID_REPEAT
+};
+
+void frame_grid_init(struct frame_grid_s* grid, double pts_interval);
+enum frame_grid_result_e frame_grid_place(struct frame_grid_s* grid,
+                                          int64_t pts, double* slot_pts);
+/** Run placement to completion without materializing repeats. Nonzero if a
+ * frame with this pts would be kept.
+ */
+char frame_grid_admit(struct frame_grid_s* grid, int64_t pts);
+
+/**
+ * One picture, shown for slots consecutive slots, interval apart. Repeats are
+ * made when they are read out, so a long run costs no more than a short one.
+ */
+struct frame_run_s {
+  AVFrame* frame;
+  // pts of the next slot to read out
+  double next_pts;
+  double interval;
+  int64_t slots;
+};
+
+/** Reads out the next slot of a run that has one. The run's own frame goes
+ * with the last slot; the ones before get clones. NULL if a clone could not
+ * be made, in which case the slot is skipped.
+ */
+AVFrame* frame_run_take(struct frame_run_s* run);
+
 /**
  * Constant rate frame buffer guarantees configured PTS interval by duplicating
  * frames as needed. Best for decoded video, but doesn't care much either way.
+ * Duplicates are made as they are read out, so a gap of any length takes the
+ * same memory.
  */
 struct frame_buffer_s;
 
@@ -22,6 +70,12 @@ void frame_buffer_free(struct frame_buffer_s* frame_buffer);
 char frame_buffer_has_next(struct frame_buffer_s* frame_buffer);
 int frame_buffer_get_next(struct frame_buffer_s* frame_buffer,
                           AVFrame** frame_out);
+/** Same as frame_buffer_get_next, a run at a time: the oldest run, or all
+ * but the last slot of the tail run, which stays behind the same way.
+ * run_out owns its frame. Nonzero if nothing is ready.
+ */
+int frame_buffer_get_next_run(struct frame_buffer_s* frame_buffer,
+                              struct frame_run_s* run_out);
 void frame_buffer_consume(struct frame_buffer_s* frame_buffer,
                           AVFrame* frame);
 
@@ -198,6 +198,112 @@ void rgb24_yuv420_std(
     }
 }
 
+// bytes_per_pixel byte pixels, with red, green and blue at byte offsets r, g
+// and b. Any other byte is skipped, so alpha is ignored, as it is in rgb24.
+// Always inlined: called with a constant param, the matrix folds into the
+// code as immediates.
+static inline void rgbx_yuv420_std(
+                      uint32_t width, uint32_t height,
+                      const uint8_t *RGBX, uint32_t RGBX_stride,
+                      uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                      const RGB2YUVParam *const param, int bytes_per_pixel, int r, int g, int b)
+    __attribute__((always_inline));
+static inline void rgbx_yuv420_std(
+                      uint32_t width, uint32_t height,
+                      const uint8_t *RGBX, uint32_t RGBX_stride,
+                      uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                      const RGB2YUVParam *const param, int bytes_per_pixel, int r, int g, int b)
+{
+// same sums, in the same order, as rgb24_yuv420_std
+#define RGBX_PIXEL(PTR, Y_OUT) \
+    y_tmp = param->matrix[0][0]*(PTR)[r] + param->matrix[0][1]*(PTR)[g] + param->matrix[0][2]*(PTR)[b]; \
+    u_tmp += param->matrix[1][0]*(PTR)[r] + param->matrix[1][1]*(PTR)[g] + param->matrix[1][2]*(PTR)[b]; \
+    v_tmp += param->matrix[2][0]*(PTR)[r] + param->matrix[2][1]*(PTR)[g] + param->matrix[2][2]*(PTR)[b]; \
+    Y_OUT=clampU8(y_tmp+((param->y_shift)<<PRECISION));
+
+    uint32_t x, y;
+    for(y=0; y<(height-1); y+=2)
+    {
+        const uint8_t *rgb_ptr1=RGBX+y*RGBX_stride,
+        *rgb_ptr2=RGBX+(y+1)*RGBX_stride;
+
+        uint8_t *y_ptr1=Y+y*Y_stride,
+        *y_ptr2=Y+(y+1)*Y_stride,
+        *u_ptr=U+(y/2)*UV_stride,
+        *v_ptr=V+(y/2)*UV_stride;
+
+        for(x=0; x<(width-1); x+=2)
+        {
+            int32_t y_tmp, u_tmp=0, v_tmp=0;
+
+            RGBX_PIXEL(rgb_ptr1, y_ptr1[0])
+            RGBX_PIXEL(rgb_ptr1+bytes_per_pixel, y_ptr1[1])
+            RGBX_PIXEL(rgb_ptr2, y_ptr2[0])
+            RGBX_PIXEL(rgb_ptr2+bytes_per_pixel, y_ptr2[1])
+
+            u_ptr[0] = clampU8(u_tmp/4+(128<<PRECISION));
+            v_ptr[0] = clampU8(v_tmp/4+(128<<PRECISION));
+
+            rgb_ptr1 += 2*bytes_per_pixel;
+            rgb_ptr2 += 2*bytes_per_pixel;
+            y_ptr1 += 2;
+            y_ptr2 += 2;
+            u_ptr += 1;
+            v_ptr += 1;
+        }
+    }
+
+#undef RGBX_PIXEL
+}
+
+void rgba32_yuv420_std(
+                       uint32_t width, uint32_t height,
+                       const uint8_t *RGBA, uint32_t RGBA_stride,
+                       uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                       YCbCrType yuv_type)
+{
+    rgbx_yuv420_std(width, height, RGBA, RGBA_stride, Y, U, V, Y_stride, UV_stride, &(RGB2YUV[yuv_type]), 4, 0, 1, 2);
+}
+
+void bgra32_yuv420_std(
+                       uint32_t width, uint32_t height,
+                       const uint8_t *BGRA, uint32_t BGRA_stride,
+                       uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                       YCbCrType yuv_type)
+{
+    rgbx_yuv420_std(width, height, BGRA, BGRA_stride, Y, U, V, Y_stride, UV_stride, &(RGB2YUV[yuv_type]), 4, 2, 1, 0);
+}
+
+// Parameter list shared by the kernels specialized on color space and layout
+// below, to fit rgb_yuv420_kernel_fn. The color space is compiled in.
+#define SPECIALIZED_ARGS \
+    uint32_t width, uint32_t height, \
+    const uint8_t *RGB, uint32_t RGB_stride, \
+    uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride
+#define SPECIALIZED_PASS width, height, RGB, RGB_stride, Y, U, V, Y_stride, UV_stride
+
+// rgb24, rgba32 and bgra32 kernels for one color space. Range goes with the
+// color space: full for JPEG, video (16-235) for BT.601 and BT.709.
+#define SPECIALIZE_STD(NAME, TYPE) \
+static void rgb24_yuv420_std_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgbx_yuv420_std(SPECIALIZED_PASS, &(RGB2YUV[TYPE]), 3, 0, 1, 2); \
+} \
+static void rgba32_yuv420_std_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgbx_yuv420_std(SPECIALIZED_PASS, &(RGB2YUV[TYPE]), 4, 0, 1, 2); \
+} \
+static void bgra32_yuv420_std_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgbx_yuv420_std(SPECIALIZED_PASS, &(RGB2YUV[TYPE]), 4, 2, 1, 0); \
+}
+
+SPECIALIZE_STD(jpeg, YCBCR_JPEG)
+SPECIALIZE_STD(601, YCBCR_601)
+SPECIALIZE_STD(709, YCBCR_709)
+
+#undef SPECIALIZE_STD
+
 #ifdef __SSE2__
 
 #define UV2RGB_16(U,V,R1,G1,B1,R2,G2,B2) \
@@ -624,3 +730,619 @@ void rgb24_yuv420_sseu(uint32_t width, uint32_t height,
 
 
 #endif //__SSE2__
+
+#ifdef __SSE2__
+
+// AVX2 version of rgb24_yuv420_std, with identical output.
+// Each 256 bit register holds 8 pixels, one per 32 bit lane, as R,G,B,0.
+// Loading 8 pixels takes two 16 byte loads, at +0 and +12, so the last
+// pixel group of a row reads 4 bytes past its own pixels.
+
+// bytes 0-11 of each 128 bit lane to 4 pixels of R,G,B,0
+#define AVX2_RGB24_SHUFFLE \
+_mm256_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128, \
+                 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11, -128)
+
+#define AVX2_LOAD_RGB24_8(PTR) \
+_mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256( \
+    _mm_loadu_si128((const __m128i*)(PTR))), \
+    _mm_loadu_si128((const __m128i*)((PTR)+12)), 1), shuffle)
+
+// weighted sum of R,G,B in each 32 bit lane, scaled by PRECISION_FACTOR
+#define AVX2_DOT_RGB(PIXELS, COEFS) \
+_mm256_madd_epi16(_mm256_maddubs_epi16(PIXELS, COEFS), _mm256_set1_epi16(1))
+
+// matrix values all fit in a signed byte, for maddubs. r, g and b are the
+// byte offsets of the channels within a 32 bit lane, the fourth weighs zero.
+static inline __m256i avx2_rgb_coefs(const int16_t row[3], int r, int g, int b)
+    __attribute__((target("avx2")));
+static inline __m256i avx2_rgb_coefs(const int16_t row[3], int r, int g, int b)
+{
+    return _mm256_set1_epi32((int32_t)(((uint32_t)(uint8_t)row[0]<<(8*r)) |
+                                       ((uint32_t)(uint8_t)row[1]<<(8*g)) |
+                                       ((uint32_t)(uint8_t)row[2]<<(8*b))));
+}
+
+// sum of four, divided the way C does it: truncating toward zero
+static inline __m256i avx2_div4(__m256i sum) __attribute__((target("avx2")));
+static inline __m256i avx2_div4(__m256i sum)
+{
+    __m256i bias = _mm256_and_si256(_mm256_srai_epi32(sum, 31), _mm256_set1_epi32(3));
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, bias), 2);
+}
+
+// inlined like rgbx_yuv420_std, to fold a constant param
+static inline void rgb24_yuv420_avx2_param(uint32_t width, uint32_t height,
+                                           const uint8_t *RGB, uint32_t RGB_stride,
+                                           uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                           const RGB2YUVParam *const param)
+    __attribute__((target("avx2"), always_inline));
+static inline void rgb24_yuv420_avx2_param(uint32_t width, uint32_t height,
+                                           const uint8_t *RGB, uint32_t RGB_stride,
+                                           uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                           const RGB2YUVParam *const param)
+{
+    const __m256i shuffle = AVX2_RGB24_SHUFFLE;
+    const __m256i y_coefs = avx2_rgb_coefs(param->matrix[0], 0, 1, 2);
+    const __m256i u_coefs = avx2_rgb_coefs(param->matrix[1], 0, 1, 2);
+    const __m256i v_coefs = avx2_rgb_coefs(param->matrix[2], 0, 1, 2);
+    const __m256i y_offset = _mm256_set1_epi32((param->y_shift)<<PRECISION);
+    const __m256i uv_offset = _mm256_set1_epi32(128<<PRECISION);
+
+    // 16 pixels per step, plus the 4 byte overread, rounded up to 2 pixels
+    uint32_t simd_width = 0;
+    if (width >= 18)
+    {
+        simd_width = ((width - 2) / 16) * 16;
+    }
+
+    uint32_t x, y;
+    for(y=0; y<(height-1); y+=2)
+    {
+        const uint8_t *rgb_ptr1=RGB+y*RGB_stride,
+        *rgb_ptr2=RGB+(y+1)*RGB_stride;
+
+        uint8_t *y_ptr1=Y+y*Y_stride,
+        *y_ptr2=Y+(y+1)*Y_stride,
+        *u_ptr=U+(y/2)*UV_stride,
+        *v_ptr=V+(y/2)*UV_stride;
+
+        for(x=0; x<simd_width; x+=16)
+        {
+            __m256i p1a = AVX2_LOAD_RGB24_8(rgb_ptr1),
+            p1b = AVX2_LOAD_RGB24_8(rgb_ptr1+24),
+            p2a = AVX2_LOAD_RGB24_8(rgb_ptr2),
+            p2b = AVX2_LOAD_RGB24_8(rgb_ptr2+24);
+
+            // luma, both lines
+            __m256i y1a = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p1a, y_coefs), y_offset), PRECISION),
+            y1b = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p1b, y_coefs), y_offset), PRECISION),
+            y2a = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p2a, y_coefs), y_offset), PRECISION),
+            y2b = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p2b, y_coefs), y_offset), PRECISION);
+            __m256i y1 = _mm256_permute4x64_epi64(_mm256_packs_epi32(y1a, y1b), 0xD8),
+            y2 = _mm256_permute4x64_epi64(_mm256_packs_epi32(y2a, y2b), 0xD8);
+            __m256i y12 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y1, y2), 0xD8);
+            _mm_storeu_si128((__m128i*)(y_ptr1), _mm256_castsi256_si128(y12));
+            _mm_storeu_si128((__m128i*)(y_ptr2), _mm256_extracti128_si256(y12, 1));
+
+            // chroma: sum each 2x2 block, then scale like the scalar code
+            __m256i ua = _mm256_add_epi32(AVX2_DOT_RGB(p1a, u_coefs), AVX2_DOT_RGB(p2a, u_coefs)),
+            ub = _mm256_add_epi32(AVX2_DOT_RGB(p1b, u_coefs), AVX2_DOT_RGB(p2b, u_coefs)),
+            va = _mm256_add_epi32(AVX2_DOT_RGB(p1a, v_coefs), AVX2_DOT_RGB(p2a, v_coefs)),
+            vb = _mm256_add_epi32(AVX2_DOT_RGB(p1b, v_coefs), AVX2_DOT_RGB(p2b, v_coefs));
+            __m256i u = _mm256_permute4x64_epi64(_mm256_hadd_epi32(ua, ub), 0xD8),
+            v = _mm256_permute4x64_epi64(_mm256_hadd_epi32(va, vb), 0xD8);
+            u = _mm256_srai_epi32(_mm256_add_epi32(avx2_div4(u), uv_offset), PRECISION);
+            v = _mm256_srai_epi32(_mm256_add_epi32(avx2_div4(v), uv_offset), PRECISION);
+            __m256i uv = _mm256_permute4x64_epi64(_mm256_packs_epi32(u, v), 0xD8);
+            uv = _mm256_packus_epi16(uv, uv);
+            _mm_storel_epi64((__m128i*)(u_ptr), _mm256_castsi256_si128(uv));
+            _mm_storel_epi64((__m128i*)(v_ptr), _mm256_extracti128_si256(uv, 1));
+
+            rgb_ptr1+=48;
+            rgb_ptr2+=48;
+            y_ptr1+=16;
+            y_ptr2+=16;
+            u_ptr+=8;
+            v_ptr+=8;
+        }
+    }
+
+    if (simd_width < width)
+    {
+        rgbx_yuv420_std(width-simd_width, height,
+                        RGB+simd_width*3, RGB_stride,
+                        Y+simd_width, U+simd_width/2, V+simd_width/2, Y_stride, UV_stride,
+                        param, 3, 0, 1, 2);
+    }
+}
+
+__attribute__((target("avx2")))
+void rgb24_yuv420_avx2(uint32_t width, uint32_t height,
+                       const uint8_t *RGB, uint32_t RGB_stride,
+                       uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                       YCbCrType yuv_type)
+{
+    rgb24_yuv420_avx2_param(width, height, RGB, RGB_stride, Y, U, V, Y_stride, UV_stride, &(RGB2YUV[yuv_type]));
+}
+
+// AVX2 version of rgbx_yuv420_std for 4 byte pixels, with identical output.
+// They load straight into 32 bit lanes; the alpha byte just gets a zero weight.
+static inline void rgbx32_yuv420_avx2(uint32_t width, uint32_t height,
+                                      const uint8_t *RGBX, uint32_t RGBX_stride,
+                                      uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                      const RGB2YUVParam *const param, int r, int g, int b)
+    __attribute__((target("avx2"), always_inline));
+static inline void rgbx32_yuv420_avx2(uint32_t width, uint32_t height,
+                                      const uint8_t *RGBX, uint32_t RGBX_stride,
+                                      uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                      const RGB2YUVParam *const param, int r, int g, int b)
+{
+    const __m256i y_coefs = avx2_rgb_coefs(param->matrix[0], r, g, b);
+    const __m256i u_coefs = avx2_rgb_coefs(param->matrix[1], r, g, b);
+    const __m256i v_coefs = avx2_rgb_coefs(param->matrix[2], r, g, b);
+    const __m256i y_offset = _mm256_set1_epi32((param->y_shift)<<PRECISION);
+    const __m256i uv_offset = _mm256_set1_epi32(128<<PRECISION);
+
+    // 16 pixels per step, no overread
+    uint32_t simd_width = width & ~15u;
+
+    uint32_t x, y;
+    for(y=0; y<(height-1); y+=2)
+    {
+        const uint8_t *rgb_ptr1=RGBX+y*RGBX_stride,
+        *rgb_ptr2=RGBX+(y+1)*RGBX_stride;
+
+        uint8_t *y_ptr1=Y+y*Y_stride,
+        *y_ptr2=Y+(y+1)*Y_stride,
+        *u_ptr=U+(y/2)*UV_stride,
+        *v_ptr=V+(y/2)*UV_stride;
+
+        for(x=0; x<simd_width; x+=16)
+        {
+            __m256i p1a = _mm256_loadu_si256((const __m256i*)(rgb_ptr1)),
+            p1b = _mm256_loadu_si256((const __m256i*)(rgb_ptr1+32)),
+            p2a = _mm256_loadu_si256((const __m256i*)(rgb_ptr2)),
+            p2b = _mm256_loadu_si256((const __m256i*)(rgb_ptr2+32));
+
+            // luma, both lines
+            __m256i y1a = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p1a, y_coefs), y_offset), PRECISION),
+            y1b = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p1b, y_coefs), y_offset), PRECISION),
+            y2a = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p2a, y_coefs), y_offset), PRECISION),
+            y2b = _mm256_srai_epi32(_mm256_add_epi32(AVX2_DOT_RGB(p2b, y_coefs), y_offset), PRECISION);
+            __m256i y1 = _mm256_permute4x64_epi64(_mm256_packs_epi32(y1a, y1b), 0xD8),
+            y2 = _mm256_permute4x64_epi64(_mm256_packs_epi32(y2a, y2b), 0xD8);
+            __m256i y12 = _mm256_permute4x64_epi64(_mm256_packus_epi16(y1, y2), 0xD8);
+            _mm_storeu_si128((__m128i*)(y_ptr1), _mm256_castsi256_si128(y12));
+            _mm_storeu_si128((__m128i*)(y_ptr2), _mm256_extracti128_si256(y12, 1));
+
+            // chroma: sum each 2x2 block, then scale like the scalar code
+            __m256i ua = _mm256_add_epi32(AVX2_DOT_RGB(p1a, u_coefs), AVX2_DOT_RGB(p2a, u_coefs)),
+            ub = _mm256_add_epi32(AVX2_DOT_RGB(p1b, u_coefs), AVX2_DOT_RGB(p2b, u_coefs)),
+            va = _mm256_add_epi32(AVX2_DOT_RGB(p1a, v_coefs), AVX2_DOT_RGB(p2a, v_coefs)),
+            vb = _mm256_add_epi32(AVX2_DOT_RGB(p1b, v_coefs), AVX2_DOT_RGB(p2b, v_coefs));
+            __m256i u = _mm256_permute4x64_epi64(_mm256_hadd_epi32(ua, ub), 0xD8),
+            v = _mm256_permute4x64_epi64(_mm256_hadd_epi32(va, vb), 0xD8);
+            u = _mm256_srai_epi32(_mm256_add_epi32(avx2_div4(u), uv_offset), PRECISION);
+            v = _mm256_srai_epi32(_mm256_add_epi32(avx2_div4(v), uv_offset), PRECISION);
+            __m256i uv = _mm256_permute4x64_epi64(_mm256_packs_epi32(u, v), 0xD8);
+            uv = _mm256_packus_epi16(uv, uv);
+            _mm_storel_epi64((__m128i*)(u_ptr), _mm256_castsi256_si128(uv));
+            _mm_storel_epi64((__m128i*)(v_ptr), _mm256_extracti128_si256(uv, 1));
+
+            rgb_ptr1+=64;
+            rgb_ptr2+=64;
+            y_ptr1+=16;
+            y_ptr2+=16;
+            u_ptr+=8;
+            v_ptr+=8;
+        }
+    }
+
+    if (simd_width < width)
+    {
+        rgbx_yuv420_std(width-simd_width, height,
+                        RGBX+simd_width*4, RGBX_stride,
+                        Y+simd_width, U+simd_width/2, V+simd_width/2, Y_stride, UV_stride,
+                        param, 4, r, g, b);
+    }
+}
+
+__attribute__((target("avx2")))
+void rgba32_yuv420_avx2(uint32_t width, uint32_t height,
+                        const uint8_t *RGBA, uint32_t RGBA_stride,
+                        uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                        YCbCrType yuv_type)
+{
+    rgbx32_yuv420_avx2(width, height, RGBA, RGBA_stride, Y, U, V, Y_stride, UV_stride, &(RGB2YUV[yuv_type]), 0, 1, 2);
+}
+
+__attribute__((target("avx2")))
+void bgra32_yuv420_avx2(uint32_t width, uint32_t height,
+                        const uint8_t *BGRA, uint32_t BGRA_stride,
+                        uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                        YCbCrType yuv_type)
+{
+    rgbx32_yuv420_avx2(width, height, BGRA, BGRA_stride, Y, U, V, Y_stride, UV_stride, &(RGB2YUV[yuv_type]), 2, 1, 0);
+}
+
+#define SPECIALIZE_AVX2(NAME, TYPE) \
+__attribute__((target("avx2"))) \
+static void rgb24_yuv420_avx2_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgb24_yuv420_avx2_param(SPECIALIZED_PASS, &(RGB2YUV[TYPE])); \
+} \
+__attribute__((target("avx2"))) \
+static void rgba32_yuv420_avx2_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgbx32_yuv420_avx2(SPECIALIZED_PASS, &(RGB2YUV[TYPE]), 0, 1, 2); \
+} \
+__attribute__((target("avx2"))) \
+static void bgra32_yuv420_avx2_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgbx32_yuv420_avx2(SPECIALIZED_PASS, &(RGB2YUV[TYPE]), 2, 1, 0); \
+}
+
+SPECIALIZE_AVX2(jpeg, YCBCR_JPEG)
+SPECIALIZE_AVX2(601, YCBCR_601)
+SPECIALIZE_AVX2(709, YCBCR_709)
+
+#undef SPECIALIZE_AVX2
+#undef AVX2_RGB24_SHUFFLE
+#undef AVX2_LOAD_RGB24_8
+#undef AVX2_DOT_RGB
+
+#endif //__SSE2__
+
+#ifdef __SSE2__
+// unaligned SSE2 for whole blocks of 32 pixels, scalar for the rest
+static void rgb24_yuv420_sse2_tail(uint32_t width, uint32_t height,
+                                   const uint8_t *RGB, uint32_t RGB_stride,
+                                   uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                   YCbCrType yuv_type)
+{
+    uint32_t simd_width = width & ~31u;
+    if (simd_width)
+    {
+        rgb24_yuv420_sseu(simd_width, height, RGB, RGB_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+    }
+    if (simd_width < width)
+    {
+        rgb24_yuv420_std(width-simd_width, height,
+                         RGB+simd_width*3, RGB_stride,
+                         Y+simd_width, U+simd_width/2, V+simd_width/2, Y_stride, UV_stride,
+                         yuv_type);
+    }
+}
+
+// rgb24 for cpus without AVX2: the generic SSE2 path, color space fixed
+#define SPECIALIZE_SSE2(NAME, TYPE) \
+static void rgb24_yuv420_sse2_##NAME(SPECIALIZED_ARGS) \
+{ \
+    rgb24_yuv420_sse2_tail(SPECIALIZED_PASS, TYPE); \
+}
+
+SPECIALIZE_SSE2(jpeg, YCBCR_JPEG)
+SPECIALIZE_SSE2(601, YCBCR_601)
+SPECIALIZE_SSE2(709, YCBCR_709)
+
+#undef SPECIALIZE_SSE2
+#endif //__SSE2__
+
+static rgb24_yuv420_fn rgb24_yuv420_select(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return rgb24_yuv420_avx2;
+    }
+    return rgb24_yuv420_sse2_tail;
+#else
+    return rgb24_yuv420_std;
+#endif
+}
+
+void rgb24_yuv420(uint32_t width, uint32_t height,
+                  const uint8_t *RGB, uint32_t RGB_stride,
+                  uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                  YCbCrType yuv_type)
+{
+    // every thread picks the same kernel, so a race here is harmless
+    static rgb24_yuv420_fn kernel = NULL;
+    rgb24_yuv420_fn fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!fn)
+    {
+        fn = rgb24_yuv420_select();
+        __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
+    }
+    fn(width, height, RGB, RGB_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
+
+static rgb24_yuv420_fn rgba32_yuv420_select(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return rgba32_yuv420_avx2;
+    }
+#endif
+    return rgba32_yuv420_std;
+}
+
+void rgba32_yuv420(uint32_t width, uint32_t height,
+                   const uint8_t *RGBA, uint32_t RGBA_stride,
+                   uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                   YCbCrType yuv_type)
+{
+    static rgb24_yuv420_fn kernel = NULL;
+    rgb24_yuv420_fn fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!fn)
+    {
+        fn = rgba32_yuv420_select();
+        __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
+    }
+    fn(width, height, RGBA, RGBA_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
+
+static rgb24_yuv420_fn bgra32_yuv420_select(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return bgra32_yuv420_avx2;
+    }
+#endif
+    return bgra32_yuv420_std;
+}
+
+void bgra32_yuv420(uint32_t width, uint32_t height,
+                   const uint8_t *BGRA, uint32_t BGRA_stride,
+                   uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                   YCbCrType yuv_type)
+{
+    static rgb24_yuv420_fn kernel = NULL;
+    rgb24_yuv420_fn fn = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+    if (!fn)
+    {
+        fn = bgra32_yuv420_select();
+        __atomic_store_n(&kernel, fn, __ATOMIC_RELAXED);
+    }
+    fn(width, height, BGRA, BGRA_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
+
+// indexed by [YCbCrType][RGBLayout]
+static const rgb_yuv420_kernel_fn std_kernels[3][3] = {
+    {rgb24_yuv420_std_jpeg, rgba32_yuv420_std_jpeg, bgra32_yuv420_std_jpeg},
+    {rgb24_yuv420_std_601, rgba32_yuv420_std_601, bgra32_yuv420_std_601},
+    {rgb24_yuv420_std_709, rgba32_yuv420_std_709, bgra32_yuv420_std_709}
+};
+
+#ifdef __SSE2__
+static const rgb_yuv420_kernel_fn avx2_kernels[3][3] = {
+    {rgb24_yuv420_avx2_jpeg, rgba32_yuv420_avx2_jpeg, bgra32_yuv420_avx2_jpeg},
+    {rgb24_yuv420_avx2_601, rgba32_yuv420_avx2_601, bgra32_yuv420_avx2_601},
+    {rgb24_yuv420_avx2_709, rgba32_yuv420_avx2_709, bgra32_yuv420_avx2_709}
+};
+
+// indexed by YCbCrType
+static const rgb_yuv420_kernel_fn sse2_rgb24_kernels[3] = {
+    rgb24_yuv420_sse2_jpeg, rgb24_yuv420_sse2_601, rgb24_yuv420_sse2_709
+};
+#endif //__SSE2__
+
+#undef SPECIALIZED_ARGS
+#undef SPECIALIZED_PASS
+
+typedef const rgb_yuv420_kernel_fn (*yuv420_kernel_table)[3];
+
+static yuv420_kernel_table yuv420_kernels_select(void)
+{
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return avx2_kernels;
+    }
+#endif
+    return std_kernels;
+}
+
+rgb_yuv420_kernel_fn rgb_yuv420_kernel(YCbCrType yuv_type, RGBLayout layout)
+{
+    static yuv420_kernel_table kernels = NULL;
+    yuv420_kernel_table table = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+    if (!table)
+    {
+        table = yuv420_kernels_select();
+        __atomic_store_n(&kernels, table, __ATOMIC_RELAXED);
+    }
+#ifdef __SSE2__
+    // SSE2 keeps the matrix in registers anyway, and beats any scalar code.
+    if (table == std_kernels && layout == RGB_LAYOUT_RGB24)
+    {
+        return sse2_rgb24_kernels[yuv_type];
+    }
+#endif
+    return table[yuv_type][layout];
+}
+
+// output pixels per strip in rgb*_yuv420_scaled. two rows of them stay in l1.
+#define SCALED_STRIP_WIDTH 128
+
+#ifdef __SSE2__
+// sum of the two pixels in each half of 4 channels by 16 bits, in the low half
+#define SSE2_PAIR_SUM(V) _mm_add_epi16(V, _mm_srli_si128(V, 8))
+
+// box_filter_row for 4 byte pixels, 4 output pixels per step. Sums fit in
+// 16 bits: at most 16 times 255. Returns the number of pixels done.
+static uint32_t box_filter_row_sse2(const uint8_t *src, uint32_t src_stride,
+                                    uint32_t scale, uint32_t width, uint8_t *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t x, j, k;
+    if (scale == 2)
+    {
+        const __m128i round = _mm_set1_epi16(2);
+        for(x=0; x+4<=width; x+=4)
+        {
+            const uint8_t *p = src + x*8;
+            __m128i sums[4];
+            for(k=0; k<2; k++)
+            {
+                __m128i a = _mm_loadu_si128((const __m128i*)(p+k*16)),
+                b = _mm_loadu_si128((const __m128i*)(p+src_stride+k*16));
+                __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+                sums[k*2] = SSE2_PAIR_SUM(lo);
+                sums[k*2+1] = SSE2_PAIR_SUM(hi);
+            }
+            __m128i out01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[0], sums[1]), round), 2),
+            out23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[2], sums[3]), round), 2);
+            _mm_storeu_si128((__m128i*)(dst+x*4), _mm_packus_epi16(out01, out23));
+        }
+    }
+    else
+    {
+        const __m128i round = _mm_set1_epi16(8);
+        for(x=0; x+4<=width; x+=4)
+        {
+            const uint8_t *p = src + x*16;
+            __m128i sums[4];
+            for(k=0; k<4; k++)
+            {
+                __m128i sum = zero;
+                for(j=0; j<4; j++)
+                {
+                    __m128i a = _mm_loadu_si128((const __m128i*)(p+j*src_stride+k*16));
+                    sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero)));
+                }
+                sums[k] = SSE2_PAIR_SUM(sum);
+            }
+            __m128i out01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[0], sums[1]), round), 4),
+            out23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[2], sums[3]), round), 4);
+            _mm_storeu_si128((__m128i*)(dst+x*4), _mm_packus_epi16(out01, out23));
+        }
+    }
+    return x;
+}
+
+#undef SSE2_PAIR_SUM
+#endif //__SSE2__
+
+// Averages each scale x scale block of a row of source pixels, rounding to
+// nearest, into 4 byte pixels. The first three channels keep their order,
+// the fourth is filler.
+static inline void box_filter_row(const uint8_t *src, uint32_t src_stride,
+                                  uint32_t bytes_per_pixel, uint32_t scale,
+                                  uint32_t width, uint8_t *dst)
+{
+    // scale is 2 or 4, so a block holds 4 or 16 pixels
+    const uint32_t shift = (scale == 2) ? 2 : 4;
+    const uint32_t round = 1 << (shift-1);
+
+    uint32_t x = 0, i, j;
+#ifdef __SSE2__
+    if (bytes_per_pixel == 4)
+    {
+        x = box_filter_row_sse2(src, src_stride, scale, width, dst);
+        dst += x*4;
+    }
+#endif
+    for(; x<width; x++)
+    {
+        uint32_t sum0=0, sum1=0, sum2=0;
+        for(j=0; j<scale; j++)
+        {
+            const uint8_t *p = src + j*src_stride + x*scale*bytes_per_pixel;
+            for(i=0; i<scale; i++)
+            {
+                sum0 += p[0];
+                sum1 += p[1];
+                sum2 += p[2];
+                p += bytes_per_pixel;
+            }
+        }
+        dst[0] = (uint8_t)((sum0+round)>>shift);
+        dst[1] = (uint8_t)((sum1+round)>>shift);
+        dst[2] = (uint8_t)((sum2+round)>>shift);
+        dst[3] = 0;
+        dst += 4;
+    }
+}
+
+// Box filters a pair of output rows at a time into a small strip buffer,
+// which then goes through the full size 4 byte pixel kernel while it is
+// still in cache. The source is read once, and never written back out at
+// full size.
+static inline void rgbx_yuv420_scaled(uint32_t scale, uint32_t bytes_per_pixel, RGBLayout strip_layout,
+                                      uint32_t width, uint32_t height,
+                                      const uint8_t *RGB, uint32_t RGB_stride,
+                                      uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                                      YCbCrType yuv_type)
+{
+    const uint32_t out_width = width/scale, out_height = height/scale;
+    const rgb_yuv420_kernel_fn convert = rgb_yuv420_kernel(yuv_type, strip_layout);
+    uint8_t strip[2][SCALED_STRIP_WIDTH*4];
+
+    uint32_t x, y;
+    for(y=0; y<out_height; y+=2)
+    {
+        const uint8_t *src1 = RGB+y*scale*RGB_stride;
+        // odd height: the last row stands in for its own missing partner
+        const char has_pair = (y+1 < out_height);
+        const uint8_t *src2 = has_pair ? src1+scale*RGB_stride : src1;
+
+        for(x=0; x<out_width; x+=SCALED_STRIP_WIDTH)
+        {
+            uint32_t strip_width = out_width-x;
+            if (strip_width > SCALED_STRIP_WIDTH)
+            {
+                strip_width = SCALED_STRIP_WIDTH;
+            }
+            if (scale == 2)
+            {
+                box_filter_row(src1+x*2*bytes_per_pixel, RGB_stride, bytes_per_pixel, 2, strip_width, strip[0]);
+                box_filter_row(src2+x*2*bytes_per_pixel, RGB_stride, bytes_per_pixel, 2, strip_width, strip[1]);
+            }
+            else
+            {
+                box_filter_row(src1+x*4*bytes_per_pixel, RGB_stride, bytes_per_pixel, 4, strip_width, strip[0]);
+                box_filter_row(src2+x*4*bytes_per_pixel, RGB_stride, bytes_per_pixel, 4, strip_width, strip[1]);
+            }
+            convert(strip_width, 2,
+                    strip[0], SCALED_STRIP_WIDTH*4,
+                    Y+y*Y_stride+x, U+(y/2)*UV_stride+x/2, V+(y/2)*UV_stride+x/2,
+                    has_pair ? Y_stride : 0, UV_stride);
+        }
+    }
+}
+
+void rgb24_yuv420_scaled(uint32_t scale,
+                         uint32_t width, uint32_t height,
+                         const uint8_t *RGB, uint32_t RGB_stride,
+                         uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                         YCbCrType yuv_type)
+{
+    rgbx_yuv420_scaled(scale, 3, RGB_LAYOUT_RGBA32, width, height, RGB, RGB_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
+
+void rgba32_yuv420_scaled(uint32_t scale,
+                          uint32_t width, uint32_t height,
+                          const uint8_t *RGBA, uint32_t RGBA_stride,
+                          uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                          YCbCrType yuv_type)
+{
+    rgbx_yuv420_scaled(scale, 4, RGB_LAYOUT_RGBA32, width, height, RGBA, RGBA_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
+
+void bgra32_yuv420_scaled(uint32_t scale,
+                          uint32_t width, uint32_t height,
+                          const uint8_t *BGRA, uint32_t BGRA_stride,
+                          uint8_t *Y, uint8_t *U, uint8_t *V, uint32_t Y_stride, uint32_t UV_stride,
+                          YCbCrType yuv_type)
+{
+    rgbx_yuv420_scaled(scale, 4, RGB_LAYOUT_BGRA32, width, height, BGRA, BGRA_stride, Y, U, V, Y_stride, UV_stride, yuv_type);
+}
@@ -16,6 +16,9 @@
 // For all methods, width and height should be even, if not, the last row/column of the result image won't be affected.
 // For sse methods, if the width if not divisable by 32, the last (width%32) pixels of each line won't be affected.
 
+#ifndef YUV_RGB_H
+#define YUV_RGB_H
+
 #include <stdint.h>
 
 typedef enum
@@ -72,3 +75,124 @@ void rgb24_yuv420_sseu(
                        const uint8_t *rgb, uint32_t rgb_stride, 
                        uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride, 
                        YCbCrType yuv_type);
+
+// rgb to yuv, avx2 implementation, same output as the standard c version
+// pointers do not need to be aligned, any width is handled
+// only call this if the cpu supports avx2
+void rgb24_yuv420_avx2(
+                       uint32_t width, uint32_t height,
+                       const uint8_t *rgb, uint32_t rgb_stride,
+                       uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                       YCbCrType yuv_type);
+
+// rgba/bgra to yuv, standard c implementation
+// 4 bytes per pixel, the alpha byte is ignored
+void rgba32_yuv420_std(
+                       uint32_t width, uint32_t height,
+                       const uint8_t *rgba, uint32_t rgba_stride,
+                       uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                       YCbCrType yuv_type);
+
+void bgra32_yuv420_std(
+                       uint32_t width, uint32_t height,
+                       const uint8_t *bgra, uint32_t bgra_stride,
+                       uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                       YCbCrType yuv_type);
+
+// rgba/bgra to yuv, avx2 implementation, same output as the standard c version
+// pointers do not need to be aligned, any width is handled
+// only call this if the cpu supports avx2
+void rgba32_yuv420_avx2(
+                        uint32_t width, uint32_t height,
+                        const uint8_t *rgba, uint32_t rgba_stride,
+                        uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                        YCbCrType yuv_type);
+
+void bgra32_yuv420_avx2(
+                        uint32_t width, uint32_t height,
+                        const uint8_t *bgra, uint32_t bgra_stride,
+                        uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                        YCbCrType yuv_type);
+
+// signature shared by the rgb24/rgba32/bgra32 to yuv420 implementations
+typedef void (*rgb24_yuv420_fn)(uint32_t width, uint32_t height,
+                                const uint8_t *rgb, uint32_t rgb_stride,
+                                uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                                YCbCrType yuv_type);
+
+// rgb to yuv, fastest implementation the cpu supports, picked on first use
+// pointers do not need to be aligned, any width is handled
+void rgb24_yuv420(
+                  uint32_t width, uint32_t height,
+                  const uint8_t *rgb, uint32_t rgb_stride,
+                  uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                  YCbCrType yuv_type);
+
+// rgba/bgra to yuv, fastest implementation the cpu supports, picked on first use
+// pointers do not need to be aligned, any width is handled
+void rgba32_yuv420(
+                   uint32_t width, uint32_t height,
+                   const uint8_t *rgba, uint32_t rgba_stride,
+                   uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                   YCbCrType yuv_type);
+
+void bgra32_yuv420(
+                   uint32_t width, uint32_t height,
+                   const uint8_t *bgra, uint32_t bgra_stride,
+                   uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                   YCbCrType yuv_type);
+
+// packed pixel layouts of the specialized kernels
+typedef enum
+{
+    RGB_LAYOUT_RGB24,
+    RGB_LAYOUT_RGBA32,
+    RGB_LAYOUT_BGRA32
+} RGBLayout;
+
+// signature of the specialized kernels. The color space is compiled into
+// each one, so there is no yuv_type to pass.
+typedef void (*rgb_yuv420_kernel_fn)(uint32_t width, uint32_t height,
+                                     const uint8_t *rgb, uint32_t rgb_stride,
+                                     uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride);
+
+// rgb/rgba/bgra to yuv, built for one color space and layout with the matrix
+// compiled in, so there is no per call lookup. The fastest one the cpu
+// supports, picked on first use; look it up once and keep it. Range comes
+// with the color space: full for YCBCR_JPEG, video for the other two.
+// Output is the same as the generic functions above.
+rgb_yuv420_kernel_fn rgb_yuv420_kernel(YCbCrType yuv_type, RGBLayout layout);
+
+// rgb/rgba/bgra to yuv at 1/scale the size, scale being 2 or 4. Each scale x scale
+// block of source pixels is averaged, then converted as above, in one pass.
+// width and height are the source size. The output is width/scale by
+// height/scale; source pixels past the last whole block are left out.
+void rgb24_yuv420_scaled(
+                         uint32_t scale,
+                         uint32_t width, uint32_t height,
+                         const uint8_t *rgb, uint32_t rgb_stride,
+                         uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                         YCbCrType yuv_type);
+
+void rgba32_yuv420_scaled(
+                          uint32_t scale,
+                          uint32_t width, uint32_t height,
+                          const uint8_t *rgba, uint32_t rgba_stride,
+                          uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                          YCbCrType yuv_type);
+
+void bgra32_yuv420_scaled(
+                          uint32_t scale,
+                          uint32_t width, uint32_t height,
+                          const uint8_t *bgra, uint32_t bgra_stride,
+                          uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                          YCbCrType yuv_type);
+
+// signature shared by the scaled implementations
+typedef void (*rgb24_yuv420_scaled_fn)(uint32_t scale,
+                                       uint32_t width, uint32_t height,
+                                       const uint8_t *rgb, uint32_t rgb_stride,
+                                       uint8_t *y, uint8_t *u, uint8_t *v, uint32_t y_stride, uint32_t uv_stride,
+                                       YCbCrType yuv_type);
+
+#endif /* YUV_RGB_H */